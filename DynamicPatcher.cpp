@@ -162,6 +162,11 @@ dpAPI void dpAddForceHostSymbolPattern(const char *pattern)
     return dpGetCurrentContext()->addForceHostSymbolPattern(pattern);
 }
 
+dpAPI const dpSymbolS* dpFindSymbolByAddress(void *addr)
+{
+    return dpGetCurrentContext()->findSymbolByAddress(addr);
+}
+
 
 dpAPI void dpAddModulePath(const char *path)
 {
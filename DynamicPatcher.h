@@ -89,6 +89,9 @@ enum dpSystemFlags {
     dpE_SysDelayedLink  = 0x2,
     dpE_SysLoadConfig   = 0x4,
     dpE_SysOpenConsole  = 0x8,
+    dpE_SysParallelLink = 0x10, // relocate sections of all modules with multiple threads. ignored when dpE_SysDelayedLink is set
+    dpE_SysLazyLibMembers = 0x20, // load members of .lib files only when they define symbols referenced by loaded modules. exports of unreferenced members are not patched
+    dpE_SysLazyDllExports = 0x40, // look up exports of .dll files by name only when referenced, instead of enumerating all of them. exports of .dll files are not patched automatically
 
     dpE_SysDefault = dpE_SysPatchExports|dpE_SysDelayedLink|dpE_SysLoadConfig,
 };
@@ -150,6 +153,7 @@ dpAPI bool   dpUnpatchByAddress(void *target_or_hook_addr);
 dpAPI void   dpUnpatchAll();
 dpAPI void*  dpGetUnpatched(void *target_or_hook_addr);
 dpAPI void   dpAddForceHostSymbolPattern(const char *pattern);
+dpAPI const dpSymbolS* dpFindSymbolByAddress(void *addr); // returns loaded symbol that contains addr. (ex: map PC to hot-loaded function)
 
 dpAPI void   dpAddModulePath(const char *path); // accepts wildcard. affects auto build and dpReload()
 dpAPI void   dpAddSourcePath(const char *path); // 
@@ -200,6 +204,7 @@ dpAPI const char*   dpGetVCVarsPath();
 #define dpUnpatchAll(...)
 #define dpGetUnpatched(...) 
 #define dpAddForceHostSymbolPattern(...) 
+#define dpFindSymbolByAddress(...) 
 
 #define dpAddModulePath(...) 
 #define dpAddSourcePath(...) 
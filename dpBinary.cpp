@@ -49,10 +49,11 @@ dpBinary::~dpBinary()
 
 dpObjFile::dpObjFile(dpContext *ctx)
     : dpBinary(ctx)
-    , m_data(nullptr), m_size(0)
     , m_aligned_data(nullptr), m_aligned_datasize(0)
+    , m_bss_data(nullptr), m_bss_datasize(0)
     , m_path(), m_mtime(0)
     , m_symbols()
+    , m_names(1024*4)
 {
 }
 
@@ -65,18 +66,22 @@ void dpObjFile::unload()
 {
     dpGetPatcher()->unpatchByBinary(this);
     eachSymbols([&](dpSymbol *sym){ dpGetLoader()->deleteSymbol(sym); });
-    if(m_data!=NULL) {
-        dpDeallocate(m_data, m_size);
-        m_data = NULL;
-        m_size = 0;
-    }
     if(m_aligned_data!=NULL) {
-        dpDeallocate(m_aligned_data, m_aligned_datasize);
+        dpGetCodeHeap().deallocate(m_aligned_data);
         m_aligned_data = NULL;
         m_aligned_datasize = 0;
     }
+    if(m_bss_data!=NULL) {
+        dpGetCodeHeap().deallocate(m_bss_data);
+        m_bss_data = NULL;
+        m_bss_datasize = 0;
+    }
     m_path.clear();
     m_symbols.clear();
+    m_linkdata.clear();
+    m_relocdata.clear();
+    m_resolvedata.clear();
+    m_names.clear();
 }
 
 
@@ -85,29 +90,83 @@ static inline const char* dpGetSymbolName(PSTR pStringTable, PIMAGE_SYMBOL pSym)
     return pSym->N.Name.Short!=0 ? (const char*)&pSym->N.ShortName : (const char*)(pStringTable + pSym->N.Name.Long);
 }
 
+// 8 文字ちょうどの短い名前は null 終端されていないので、長さを制限して取り出す
+static inline const char* dpInternSymbolName(dpStringArena &arena, PSTR pStringTable, PIMAGE_SYMBOL pSym)
+{
+    const char *name = dpGetSymbolName(pStringTable, pSym);
+    return pSym->N.Name.Short!=0 ? arena.intern(name, strnlen(name, 8)) : arena.intern(name);
+}
+
+// 実行時に必要になる section か。.drectve や .debug$ などはリンク時の情報でしかない
+static inline bool dpIsResidentSection(const IMAGE_SECTION_HEADER &sect)
+{
+    return (sect.Characteristics & (IMAGE_SCN_LNK_INFO|IMAGE_SCN_LNK_REMOVE|IMAGE_SCN_MEM_DISCARDABLE))==0;
+}
+
+// ファイル上に中身を持たない section (.bss) か
+static inline bool dpIsUninitializedSection(const IMAGE_SECTION_HEADER &sect)
+{
+    return (sect.Characteristics & IMAGE_SCN_CNT_UNINITIALIZED_DATA)!=0 && sect.PointerToRawData==0;
+}
+
+// FNV-1a (64bit)
+static inline uint64_t dpHashBytes(const void *data, size_t size, uint64_t h=14695981039346656037ULL)
+{
+    const BYTE *p = (const BYTE*)data;
+    for(size_t i=0; i<size; ++i) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// NumberOfRelocations==0xffff の場合、最初の IMAGE_RELOCATION に実際の値が入っている。(NumberOfRelocations は 16bit のため)
+static inline DWORD dpGetNumRelocations(size_t ImageBase, const IMAGE_SECTION_HEADER &sect)
+{
+    if(sect.NumberOfRelocations==0xffff && (sect.Characteristics&IMAGE_SCN_LNK_NRELOC_OVFL)!=0) {
+        return ((PIMAGE_RELOCATION)(ImageBase + (int)sect.PointerToRelocations))[0].RelocCount;
+    }
+    return sect.NumberOfRelocations;
+}
+
 bool dpObjFile::loadFile(const char *path)
 {
     dpTime mtime = dpGetMTime(path);
     if(m_symbols.getNumSymbols()>0 && mtime<=m_mtime) { return true; }
 
-    void *data;
+    // map し続けるとコンパイラが .obj を書き換えられなくなるので、ロードが終わったらすぐに解放する
+    const void *view;
     size_t size;
-    if(!dpMapFile(path, data, size, dpAllocateModule)) {
+    if(!dpMapFileView(path, view, size)) {
         dpPrintError("file not found %s\n", path);
         return false;
     }
-    return loadMemory(path, data, size, mtime);
+    bool ret = loadView(path, view, size, mtime);
+    dpUnmapFileView(view);
+    return ret;
 }
 
-bool dpObjFile::loadMemory(const char *path, void *data, size_t size, dpTime mtime)
+bool dpObjFile::loadView(const char *path, const void *view, size_t size, dpTime mtime)
 {
     if(m_symbols.getNumSymbols()>0 && mtime<=m_mtime) { return true; }
+    if(size<sizeof(IMAGE_FILE_HEADER)) { return false; }
+
+    // ヘッダ、symbol table、再配置情報は view から直接読む。
+    // 実行時に必要な section だけが loadImpl() で m_aligned_data にコピーされ、それ以外はどこにもコピーしない
+    return loadImpl(path, view, size, mtime);
+}
+
+// data は呼び出し側のもので、書き換えも解放もしない (loadView() と同じく必要な section だけコピーして使う)
+bool dpObjFile::loadMemory(const char *path, void *data, size_t size, dpTime mtime)
+{
+    return loadView(path, data, size, mtime);
+}
+
+bool dpObjFile::loadImpl(const char *path, const void *data, size_t size, dpTime mtime)
+{
     m_path = path; dpSanitizePath(m_path);
-    m_data = data;
-    m_size = size;
     m_mtime = mtime;
 
-    size_t ImageBase = (size_t)(m_data);
+    size_t ImageBase = (size_t)(data);
     PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)ImageBase;
 #ifdef _WIN64
     if( pDosHeader->e_magic!=IMAGE_FILE_MACHINE_AMD64 || pDosHeader->e_sp!=0 ) {
@@ -126,36 +185,159 @@ bool dpObjFile::loadMemory(const char *path, void *data, size_t size, dpTime mti
     DWORD SymbolCount = pImageHeader->NumberOfSymbols;
     PSTR StringTable = (PSTR)&pSymbolTable[SymbolCount];
 
-    m_linkdata.resize(pImageHeader->NumberOfSections);
+    m_linkdata.assign(pImageHeader->NumberOfSections, LinkData());
+    m_resolvedata.clear();
 
-    // アラインが必要な section をアラインしつつ新しい領域に移す
+    // 実行時に必要な section をアラインしつつ新しい領域に移す。
+    // .debug$ や .drectve など、リンク時にしか使われない section は移さない (リンクもしない)
+    // .bss は別の領域に置き、コピーも 0 埋めもしない。大きいものは触られるまで物理メモリを使わない
+    // data は書き換えないので、section のロード先は別に持っておく
+    std::vector<char*> sect_data(pImageHeader->NumberOfSections);
     m_aligned_data = NULL;
     m_aligned_datasize = 0xffffffff;
+    m_bss_data = NULL;
+    m_bss_datasize = 0xffffffff;
+    size_t max_align = 16, max_bss_align = 16;
     for(size_t ti=0; ti<2; ++ti) {
         // ti==0 で必要な容量を調べ、ti==1 で実際のメモリ確保と再配置を行う
         dpSectionAllocator salloc(m_aligned_data, m_aligned_datasize);
+        dpSectionAllocator balloc(m_bss_data, m_bss_datasize);
 
         for(size_t si=0; si<pImageHeader->NumberOfSections; ++si) {
             IMAGE_SECTION_HEADER &sect = pSectionHeader[si];
-            // IMAGE_SECTION_HEADER::Characteristics にアライン情報が詰まっている
-            DWORD align = 1 << (((sect.Characteristics & 0x00f00000) >> 20) - 1);
-            if(align==1) {
+            if(!dpIsResidentSection(sect)) {
                 // do nothing
                 continue;
             }
-            else {
-                if(void *rd = salloc.allocate(sect.SizeOfRawData, align)) {
-                    if(sect.PointerToRawData != 0) {
-                        memcpy(rd, (void*)(ImageBase + sect.PointerToRawData), sect.SizeOfRawData);
-                    }
-                    sect.PointerToRawData = (DWORD)((size_t)rd - ImageBase);
+            // IMAGE_SECTION_HEADER::Characteristics にアライン情報が詰まっている。指定が無い場合は 16
+            DWORD align_bits = (sect.Characteristics & 0x00f00000) >> 20;
+            DWORD align = align_bits!=0 ? 1 << (align_bits-1) : 16;
+            if(dpIsUninitializedSection(sect)) {
+                if(align>max_bss_align) { max_bss_align = align; }
+                if(void *rd = balloc.allocate(sect.SizeOfRawData, align)) {
+                    sect_data[si] = (char*)rd;
+                }
+                continue;
+            }
+            if(align>max_align) { max_align = align; }
+            if(void *rd = salloc.allocate(sect.SizeOfRawData, align)) {
+                if(sect.PointerToRawData != 0) {
+                    memcpy(rd, (const char*)(ImageBase + sect.PointerToRawData), sect.SizeOfRawData);
                 }
+                sect_data[si] = (char*)rd;
             }
         }
 
         if(ti==0) {
             m_aligned_datasize = salloc.getUsed();
-            m_aligned_data = dpAllocateForward(m_aligned_datasize, m_data);
+            m_bss_datasize = balloc.getUsed();
+            // ti==0 では先頭を 0 番地として align を計算しているので、先頭は最大の align に揃っている必要がある
+            m_aligned_data = dpGetCodeHeap().allocate(m_aligned_datasize, max_align, ::GetModuleHandleA(nullptr));
+            m_bss_data = dpGetCodeHeap().allocateDemandZero(m_bss_datasize, max_bss_align, ::GetModuleHandleA(nullptr));
+        }
+    }
+    {
+        size_t num_resident = 0, num_skipped = 0, skipped_size = 0;
+        for(size_t si=0; si<pImageHeader->NumberOfSections; ++si) {
+            IMAGE_SECTION_HEADER &sect = pSectionHeader[si];
+            if(dpIsResidentSection(sect)) { ++num_resident; }
+            else { ++num_skipped; skipped_size+=sect.SizeOfRawData; }
+        }
+        dpPrintDetail("%s: %d sections resident (%d bytes, %d bytes bss), %d sections skipped (%d bytes)\n",
+            m_path.c_str(), (int)num_resident, (int)m_aligned_datasize, (int)m_bss_datasize, (int)num_skipped, (int)skipped_size);
+    }
+
+    // code section の内容のハッシュ。この時点ではまだ再配置されていないので、再配置先は名前で混ぜておけば
+    // ロードされたアドレスに依存しない値になり、前のバージョンの obj と関数 (/Gy の COMDAT) 単位で比較できる
+    {
+        std::vector<uint64_t> raw_hashes(pImageHeader->NumberOfSections);
+        auto get_raw_hash = [&](size_t si) -> uint64_t {
+            IMAGE_SECTION_HEADER &sect = pSectionHeader[si];
+            if(raw_hashes[si]==0 && dpIsResidentSection(sect)) {
+                // .bss の中身は常に 0 なので、読んでページを触らないようサイズだけで済ませる
+                raw_hashes[si] = (sect.Characteristics & IMAGE_SCN_CNT_UNINITIALIZED_DATA)!=0 ?
+                    dpHashBytes(&sect.SizeOfRawData, sizeof(sect.SizeOfRawData)) :
+                    dpHashBytes(sect_data[si], sect.SizeOfRawData);
+            }
+            return raw_hashes[si];
+        };
+        for(size_t si=0; si<pImageHeader->NumberOfSections; ++si) {
+            IMAGE_SECTION_HEADER &sect = pSectionHeader[si];
+            if(!dpIsResidentSection(sect) || (sect.Characteristics&IMAGE_SCN_CNT_CODE)==0) { continue; }
+            uint64_t h = get_raw_hash(si);
+            DWORD NumRelocations = dpGetNumRelocations(ImageBase, sect);
+            DWORD FirstRelocation = sect.NumberOfRelocations==0xffff && (sect.Characteristics&IMAGE_SCN_LNK_NRELOC_OVFL)!=0 ? 1 : 0;
+            PIMAGE_RELOCATION pRelocation = (PIMAGE_RELOCATION)(ImageBase + (int)sect.PointerToRelocations);
+            for(size_t ri=FirstRelocation; ri<NumRelocations; ++ri) {
+                PIMAGE_RELOCATION pReloc = pRelocation + ri;
+                h = dpHashBytes(&pReloc->VirtualAddress, sizeof(pReloc->VirtualAddress), h);
+                h = dpHashBytes(&pReloc->Type, sizeof(pReloc->Type), h);
+                if(pReloc->SymbolTableIndex>=SymbolCount) { continue; }
+                PIMAGE_SYMBOL rsym = pSymbolTable + pReloc->SymbolTableIndex;
+                const char *rname = dpGetSymbolName(StringTable, rsym);
+                h = dpHashBytes(rname, rsym->N.Name.Short!=0 ? strnlen(rname, 8) : strlen(rname), h);
+                // static な symbol (文字列リテラルや section 内のラベル) は名前だけでは中身が変わったか分からない
+                if(rsym->SectionNumber>0) {
+                    h = dpHashBytes(&rsym->Value, sizeof(rsym->Value), h);
+                    if(rsym->StorageClass==IMAGE_SYM_CLASS_STATIC && (size_t)rsym->SectionNumber-1!=si) {
+                        uint64_t th = get_raw_hash(rsym->SectionNumber-1);
+                        h = dpHashBytes(&th, sizeof(th), h);
+                    }
+                }
+            }
+            m_linkdata[si].hash = h!=0 ? h : 1;
+        }
+    }
+
+    // 再配置情報は section 毎に m_relocdata の連続した領域に移す。
+    // 参照先の symbol は m_resolvedata に 1 つずつ割り当て、名前は m_names に移しておく
+    {
+        uint32_t num_relocations = 0;
+        for(size_t si=0; si<pImageHeader->NumberOfSections; ++si) {
+            IMAGE_SECTION_HEADER &sect = pSectionHeader[si];
+            if(dpIsResidentSection(sect)) {
+                num_relocations += dpGetNumRelocations(ImageBase, sect);
+            }
+        }
+        m_relocdata.clear();
+        m_relocdata.reserve(num_relocations);
+
+        std::vector<uint32_t> targets(SymbolCount, UINT32_MAX); // symbol index -> m_resolvedata
+        for(size_t si=0; si<pImageHeader->NumberOfSections; ++si) {
+            IMAGE_SECTION_HEADER &sect = pSectionHeader[si];
+            LinkData &ld = m_linkdata[si];
+            ld.reloc_offset = (uint32_t)m_relocdata.size();
+            if(!dpIsResidentSection(sect)) { continue; }
+            ld.base = (size_t)sect_data[si];
+
+            DWORD NumRelocations = dpGetNumRelocations(ImageBase, sect);
+            DWORD FirstRelocation = sect.NumberOfRelocations==0xffff && (sect.Characteristics&IMAGE_SCN_LNK_NRELOC_OVFL)!=0 ? 1 : 0;
+            PIMAGE_RELOCATION pRelocation = (PIMAGE_RELOCATION)(ImageBase + (int)sect.PointerToRelocations);
+            for(size_t ri=FirstRelocation; ri<NumRelocations; ++ri) {
+                PIMAGE_RELOCATION pReloc = pRelocation + ri;
+                DWORD index = pReloc->SymbolTableIndex;
+                if(index>=SymbolCount) { continue; }
+                if(targets[index]==UINT32_MAX) {
+                    PIMAGE_SYMBOL rsym = pSymbolTable + index;
+                    ResolveData rd;
+                    rd.name = dpInternSymbolName(m_names, StringTable, rsym);
+                    rd.undefined = rsym->SectionNumber==IMAGE_SYM_UNDEFINED;
+                    // '$' で始まる symbol はこの obj の中でしか参照されないので、ここで解決しておく
+                    if(rd.name[0]=='$' && rsym->SectionNumber>0 && sect_data[rsym->SectionNumber-1]) {
+                        rd.address = (size_t)(sect_data[rsym->SectionNumber-1] + rsym->Value);
+                        rd.owner = this;
+                        rd.state = dpE_Resolved;
+                    }
+                    targets[index] = (uint32_t)m_resolvedata.size();
+                    m_resolvedata.push_back(rd);
+                }
+                RelocationData reloc;
+                reloc.offset = pReloc->VirtualAddress;
+                reloc.target = targets[index];
+                reloc.type = pReloc->Type;
+                m_relocdata.push_back(reloc);
+            }
+            ld.num_relocations = (uint32_t)m_relocdata.size() - ld.reloc_offset;
         }
     }
 
@@ -165,11 +347,11 @@ bool dpObjFile::loadMemory(const char *path, void *data, size_t size, dpTime mti
         //const char *name = GetSymbolName(StringTable, sym);
         if(sym->SectionNumber>0) {
             IMAGE_SECTION_HEADER &sect = pSectionHeader[sym->SectionNumber-1];
-            m_relocdata.resize(m_relocdata.size()+sect.NumberOfRelocations);
-            void *data = (void*)(ImageBase + (int)sect.PointerToRawData + sym->Value);
             if(sym->SectionNumber==IMAGE_SYM_UNDEFINED) { continue; }
             const char *name = dpGetSymbolName(StringTable, sym);
-            if(name[0]!='.' && name[0]!='$') {
+            if(dpIsResidentSection(sect) && name[0]!='.' && name[0]!='$') {
+                void *data = sect_data[sym->SectionNumber-1] + sym->Value;
+                name = dpInternSymbolName(m_names, StringTable, sym);
                 DWORD flags = 0;
                 if((sect.Characteristics&IMAGE_SCN_CNT_CODE))               { flags|=dpE_Code; }
                 if((sect.Characteristics&IMAGE_SCN_CNT_INITIALIZED_DATA))   { flags|=dpE_IData; }
@@ -178,7 +360,8 @@ bool dpObjFile::loadMemory(const char *path, void *data, size_t size, dpTime mti
                 if((sect.Characteristics&IMAGE_SCN_MEM_WRITE))   { flags|=dpE_Write; }
                 if((sect.Characteristics&IMAGE_SCN_MEM_EXECUTE)) { flags|=dpE_Execute; }
                 if((sect.Characteristics&IMAGE_SCN_MEM_SHARED))  { flags|=dpE_Shared; }
-                m_symbols.addSymbol(dpGetLoader()->newSymbol(name, data, flags, sym->SectionNumber-1, this));
+                size_t size = sect.SizeOfRawData>sym->Value ? sect.SizeOfRawData-sym->Value : 0;
+                m_symbols.addSymbol(dpGetLoader()->newSymbol(name, data, flags, sym->SectionNumber-1, this, size));
             }
         }
         i += pSymbolTable[i].NumberOfAuxSymbols;
@@ -188,21 +371,21 @@ bool dpObjFile::loadMemory(const char *path, void *data, size_t size, dpTime mti
     for(size_t si=0; si<pImageHeader->NumberOfSections; ++si) {
         IMAGE_SECTION_HEADER &sect = pSectionHeader[si];
         // .drectve section には linker directive が入っており、dllexport 付き symbol のリストがここに含まれる
+        // この section は m_aligned_data に移されていないので、ファイルのイメージから直接読む
         if(strncmp((char*)sect.Name, ".drectve", 8)==0) {
-            char *data = (char*)(ImageBase + sect.PointerToRawData);
-            data[sect.SizeOfRawData] = '\0';
+            std::string directive((const char*)(ImageBase + sect.PointerToRawData), sect.SizeOfRawData);
+            const char *data = directive.c_str();
             std::regex reg("/EXPORT:([^ ,]+)");
             std::cmatch m;
             size_t pos = 0;
             for(;;) {
                 if(std::regex_search(data+pos, m, reg)) {
-                    char *name = data+pos+m.position(1);
-                    name[m.length(1)] = '\0';
-                    if(dpSymbol *s = m_symbols.findSymbolByName(name)) {
+                    std::string name = m.str(1);
+                    if(dpSymbol *s = m_symbols.findSymbolByName(name.c_str())) {
                         s->flags |= dpE_Export;
                     }
-                    pos += m.position()+m.length()+1;
-                    if(pos>=sect.SizeOfRawData) { break; }
+                    pos += m.position()+m.length();
+                    if(pos>=directive.size()) { break; }
                 }
                 else {
                     break;
@@ -215,13 +398,117 @@ bool dpObjFile::loadMemory(const char *path, void *data, size_t size, dpTime mti
     return true;
 }
 
-// 外部シンボルのリンケージ解決
+// 再配置から参照されている未定義の symbol のうち、まだ解決されていないものを列挙する。リンクされない section からの参照は含まない
+template<class F>
+void dpObjFile::eachReferencedUndefinedSymbols(const F &f)
+{
+    for(size_t i=0; i<m_resolvedata.size(); ++i) {
+        ResolveData &rd = m_resolvedata[i];
+        if(rd.undefined && rd.state==dpE_Unresolved) {
+            f(rd);
+        }
+    }
+}
+
+void dpObjFile::eachUndefinedSymbols(const std::function<void (const char*)> &f)
+{
+    eachReferencedUndefinedSymbols([&](ResolveData &rd){ f(rd.name); });
+}
+
+// 解決結果を m_resolvedata に入れておく。
+// 解決できなかったものは未解決のままにしておき、partialLink() の時点で改めて解決を試みてエラーを出す
+void dpObjFile::resolveUndefinedSymbols(const std::function<const dpSymbol* (const char*)> &resolver)
+{
+    eachReferencedUndefinedSymbols([&](ResolveData &rd){
+        const dpSymbol *sym = resolver(rd.name);
+        if(sym && sym->address) {
+            rd.address = (size_t)sym->address;
+            rd.owner = sym->binary;
+            rd.state = dpE_Resolved;
+        }
+    });
+}
+
+// 解決先が古くなった symbol と、前回解決に失敗したが今回は解決できうる symbol を未解決に戻し、それらを参照する section を要リンクにする。
+// 判定は m_resolvedata の要素毎に 1 度だけ行う
+bool dpObjFile::invalidateLink(const std::function<bool (const dpBinary*, const char*)> &is_stale, const std::function<bool (const char*)> &is_resolvable)
+{
+    std::vector<bool> stale(m_resolvedata.size());
+    bool any_stale = false;
+    for(size_t i=0; i<m_resolvedata.size(); ++i) {
+        ResolveData &rd = m_resolvedata[i];
+        if((rd.state==dpE_ResolveFailed && is_resolvable(rd.name)) ||
+            (rd.state==dpE_Resolved && rd.owner!=this && is_stale(rd.owner, rd.name)))
+        {
+            rd.address = 0;
+            rd.owner = nullptr;
+            rd.state = dpE_Unresolved;
+            stale[i] = true;
+            any_stale = true;
+        }
+    }
+
+    bool ret = false;
+    for(size_t si=0; si<m_linkdata.size(); ++si) {
+        LinkData &ld = m_linkdata[si];
+        if(any_stale && (ld.flags & dpE_NeedsLink)==0) {
+            for(size_t ri=0; ri<ld.num_relocations; ++ri) {
+                if(stale[m_relocdata[ld.reloc_offset + ri].target]) {
+                    ld.flags |= dpE_NeedsLink;
+                    break;
+                }
+            }
+        }
+        if(ld.flags & dpE_NeedsLink) { ret = true; }
+    }
+    return ret;
+}
+
+// 同じ symbol を参照する再配置は多いので、m_resolvedata の要素毎に 1 度だけ名前を引いて解決する。
+// 解決できなかったものもエラーは 1 度だけ出す
+size_t dpObjFile::resolveRelocationTarget(uint32_t target)
+{
+    ResolveData &rd = m_resolvedata[target];
+    if(rd.state==dpE_Unresolved) {
+        if(const dpSymbol *sym = resolveSymbol(rd.name)) {
+            rd.address = (size_t)sym->address;
+            rd.owner = sym->binary;
+        }
+        rd.state = rd.address!=0 ? dpE_Resolved : dpE_ResolveFailed;
+        if(rd.state==dpE_ResolveFailed) {
+            dpPrintError("symbol \"%s\" (referenced by \"%s\") cannot be resolved.\n", rd.name, m_path.c_str());
+        }
+    }
+    return rd.address;
+}
+
+// partialLink() の中で symbol の解決 (dpLoader や他 binary の symbol table への問い合わせ) が起きないよう、
+// リンクされる section の再配置が参照する symbol を全て先に解決しておく
+void dpObjFile::prepareParallelLink()
+{
+    for(size_t si=0; si<m_linkdata.size(); ++si) {
+        const LinkData &ld = m_linkdata[si];
+        if((ld.flags & dpE_NeedsLink)==0) { continue; }
+        for(size_t ri=0; ri<ld.num_relocations; ++ri) {
+            resolveRelocationTarget(m_relocdata[ld.reloc_offset + ri].target);
+        }
+    }
+}
+
+size_t dpObjFile::getNumSections() const { return m_linkdata.size(); }
+
+uint64_t dpObjFile::getSectionHash(size_t section) const
+{
+    return section<m_linkdata.size() ? m_linkdata[section].hash : 0;
+}
+
+// 外部シンボルのリンケージ解決。
+// 要リンクの section だけが対象で、ロード直後は全 section、以降は invalidateLink() で要リンクに戻された section になる
 bool dpObjFile::link()
 {
     size_t num_sections = m_linkdata.size();
-    for(size_t si=0; si<num_sections; ++si) {
-        m_linkdata[si].flags |= dpE_NeedsLink;
-    }
+    // 未定義の外部 symbol は dpLoader::link() で resolveUndefinedSymbols() によって解決済み。
+    // 遅延リンクの場合は解決されておらず、partialLink() の際に resolveRelocationTarget() で解決する
     if((dpGetConfig().sys_flags&dpE_SysDelayedLink)==0) {
         for(size_t si=0; si<num_sections; ++si) {
             if(!partialLink(si)) {
@@ -243,41 +530,20 @@ bool dpObjFile::partialLink(size_t si)
 
     bool ret = true;
 
-    size_t ImageBase = (size_t)(m_data);
-    PIMAGE_FILE_HEADER pImageHeader = (PIMAGE_FILE_HEADER)ImageBase;
-    PIMAGE_SECTION_HEADER pSectionHeader = (PIMAGE_SECTION_HEADER)(ImageBase + sizeof(IMAGE_FILE_HEADER) + pImageHeader->SizeOfOptionalHeader);
-    PIMAGE_SYMBOL pSymbolTable = (PIMAGE_SYMBOL)((size_t)pImageHeader + pImageHeader->PointerToSymbolTable);
-    DWORD SymbolCount = pImageHeader->NumberOfSymbols;
-    PSTR StringTable = (PSTR)(pSymbolTable+SymbolCount);
+    // ロード時に移されなかった section は実行時には使われないのでリンクも不要
+    if(ld.base!=0) {
+        size_t SectionBase = ld.base;
+        dpPrintDetail("partial link %s SECT%X\n", getPath(), si);
 
-    if(si < pImageHeader->NumberOfSections) {
-        IMAGE_SECTION_HEADER &sect = pSectionHeader[si];
-        size_t SectionBase = (size_t)(ImageBase + (int)sect.PointerToRawData);
-        dpPrintDetail("partial link %s SECT%X \"%s\"\n", getPath(), si, sect.Name);
-
-        DWORD NumRelocations = sect.NumberOfRelocations;
-        DWORD FirstRelocation = 0;
-        // NumberOfRelocations==0xffff の場合、最初の IMAGE_RELOCATION に実際の値が入っている。(NumberOfRelocations は 16bit のため)
-        if(sect.NumberOfRelocations==0xffff && (sect.Characteristics&IMAGE_SCN_LNK_NRELOC_OVFL)!=0) {
-            NumRelocations = ((PIMAGE_RELOCATION)(ImageBase + (int)sect.PointerToRelocations))[0].RelocCount;
-            FirstRelocation = 1;
-        }
-
-        PIMAGE_RELOCATION pRelocation = (PIMAGE_RELOCATION)(ImageBase + (int)sect.PointerToRelocations);
-        for(size_t ri=FirstRelocation; ri<NumRelocations; ++ri) {
-            RelocationData &reloc = m_relocdata[ri];
-            PIMAGE_RELOCATION pReloc = pRelocation + ri;
-            PIMAGE_SYMBOL rsym = pSymbolTable + pReloc->SymbolTableIndex;
-            const char *rname = dpGetSymbolName(StringTable, rsym);
-            size_t rdata = 0;
-            if(rname[0]=='$') {
-                rdata = (size_t)(ImageBase + (int)pSectionHeader[rsym->SectionNumber-1].PointerToRawData + rsym->Value);
-            }
-            else {
-                rdata = (size_t)resolveSymbol(rname);
+        for(size_t ri=0; ri<ld.num_relocations; ++ri) {
+            RelocationData &reloc = m_relocdata[ld.reloc_offset + ri];
+            size_t addr = SectionBase + reloc.offset;
+            // 初回のリンクで再配置前の値 (addend) を保存しておき、再リンク時はそれを元に計算する
+            if(ld.flags & dpE_NeedsBase) {
+                reloc.base = *(DWORD*)(addr);
             }
+            size_t rdata = resolveRelocationTarget(reloc.target);
             if(rdata==NULL) {
-                dpPrintError("symbol \"%s\" (referenced by \"%s\") cannot be resolved.\n", rname, m_path.c_str());
                 ret = false;
                 continue;
             }
@@ -298,19 +564,14 @@ bool dpObjFile::partialLink(size_t si)
                 IMAGE_DIR32NB   = IMAGE_REL_I386_DIR32NB,
 #endif
             };
-            size_t addr = SectionBase + pReloc->VirtualAddress;
-            if(ld.flags & dpE_NeedsBase) {
-                reloc.base = *(DWORD*)(addr);
-                ld.flags &= ~dpE_NeedsBase;
-            }
 
             // IMAGE_RELOCATION::Type に応じて再配置
-            switch(pReloc->Type) {
+            switch(reloc.type) {
             case IMAGE_SECTION: break; // 
             case IMAGE_SECREL:  break; // デバッグ情報にしか出てこない (はず)
             case IMAGE_REL32:
                 {
-                    DWORD rel = (DWORD)(rdata - SectionBase - pReloc->VirtualAddress - 4);
+                    DWORD rel = (DWORD)(rdata - SectionBase - reloc.offset - 4);
                     *(DWORD*)(addr) = (DWORD)(reloc.base + rel);
                 }
                 break;
@@ -332,10 +593,11 @@ bool dpObjFile::partialLink(size_t si)
                 break;
 #endif // _WIN64
             default:
-                dpPrintWarning("unknown IMAGE_RELOCATION::Type 0x%x\n", pReloc->Type);
+                dpPrintWarning("unknown IMAGE_RELOCATION::Type 0x%x\n", reloc.type);
                 break;
             }
         }
+        ld.flags &= ~dpE_NeedsBase;
     }
 
     if(!ret) {
@@ -361,29 +623,21 @@ dpSymbolTable& dpObjFile::getSymbolTable()            { return m_symbols; }
 const char*    dpObjFile::getPath() const             { return m_path.c_str(); }
 dpTime         dpObjFile::getLastModifiedTime() const { return m_mtime; }
 dpFileType     dpObjFile::getFileType() const         { return FileType; }
-void*          dpObjFile::getBaseAddress() const      { return m_data; }
+void*          dpObjFile::getBaseAddress() const      { return m_aligned_data; }
+size_t         dpObjFile::getResidentSize() const     { return m_aligned_datasize + m_bss_datasize; }
 
-void* dpObjFile::resolveSymbol( const char *name )
+const dpSymbol* dpObjFile::resolveSymbol( const char *name )
 {
     if(dpGetLoader()->doesForceHostSymbol(name)) {
         return dpGetLoader()->findHostSymbolByName(name);
     }
 
-    void *sym = nullptr;
-    {
-        if(const dpSymbol *s=getSymbolTable().findSymbolByName(name)) {
-            sym = s->address;
-        }
-    }
+    const dpSymbol *sym = getSymbolTable().findSymbolByName(name);
     if(!sym) {
-        if(const dpSymbol *s=dpGetLoader()->findSymbolByName(name)) {
-            sym = s->address;
-        }
+        sym = dpGetLoader()->findSymbolByName(name);
     }
     if(!sym) {
-        if(const dpSymbol *s=dpGetLoader()->findHostSymbolByName(name)) {
-            sym = s->address;
-        }
+        sym = dpGetLoader()->findHostSymbolByName(name);
     }
     return sym;
 }
@@ -392,7 +646,11 @@ void* dpObjFile::resolveSymbol( const char *name )
 
 dpLibFile::dpLibFile(dpContext *ctx)
     : dpBinary(ctx)
+    , m_predecessor(nullptr)
     , m_mtime(0)
+    , m_num_members(0)
+    , m_member_names(1024*16)
+    , m_longnames(0)
 {
 }
 
@@ -405,13 +663,48 @@ void dpLibFile::unload()
 {
     eachObjs([](dpObjFile *o){ delete o; });
     m_objs.clear();
+    m_checksums.clear();
+    m_obj_index.clear();
     m_symbols.clear();
+    m_members.clear();
+    m_loaded_members.clear();
+    m_num_members = 0;
+    m_member_names.clear();
+    m_longnames = 0;
+}
+
+void dpLibFile::setPredecessor(dpLibFile *prev)
+{
+    m_predecessor = prev;
 }
 
 bool dpLibFile::loadFile(const char *path)
 {
+    // 引き継ぎ元は今回のロードでしか使わない (この後すぐ破棄される)
+    struct ClearPredecessor {
+        dpLibFile *self;
+        ~ClearPredecessor() { self->m_predecessor = nullptr; }
+    } clear_predecessor = {this};
+
     dpTime mtime = dpGetMTime(path);
-    if(!m_objs.empty() && mtime<=m_mtime) { return true; }
+    if((!m_objs.empty() || !m_members.empty()) && mtime<=m_mtime) { return true; }
+
+    // 遅延ロードの場合は linker member の index だけ読んでおき、member は必要になった時点でファイルを map し直して読む
+    if((dpGetConfig().sys_flags&dpE_SysLazyLibMembers)!=0) {
+        const void *view;
+        size_t size;
+        if(!dpMapFileView(path, view, size)) {
+            dpPrintError("file not found %s\n", path);
+            return false;
+        }
+        bool ret = loadIndex(path, view, size, mtime);
+        if(!ret) {
+            // index が無い .lib は全 member をロードする
+            ret = loadMemory(path, (void*)view, size, mtime);
+        }
+        dpUnmapFileView(view);
+        return ret;
+    }
 
     void *lib_data;
     size_t lib_size;
@@ -424,6 +717,31 @@ bool dpLibFile::loadFile(const char *path)
     return ret;
 }
 
+// member の名前は obj の path と同じく dpSanitizePath() したものとして扱い、大文字小文字は区別しない
+static uint32_t dpHashMemberName(const char *name)
+{
+    std::string lower(name);
+    dpSanitizePath(lower);
+    dpEach(lower, [](char &c){ c = (char)tolower((unsigned char)c); });
+    return dpHashName(lower.c_str(), lower.size());
+}
+
+// archive member の名前を取り出す
+static void dpGetArchiveMemberName(PIMAGE_ARCHIVE_MEMBER_HEADER header, const char *name_section, std::string &name)
+{
+    // Name が '/'+数字 の場合、その数字は long name セクションの offset 値
+    if(header->Name[0]=='/') {
+        DWORD offset = 0;
+        sscanf((char*)header->Name+1, "%d", &offset);
+        name = name_section ? name_section+offset : "";
+    }
+    // それ以外の場合 Name にはファイル名が入っている。null terminated ではないので注意が必要 ('/' で終わる)
+    else {
+        char *s = std::find((char*)header->Name, (char*)header->Name+sizeof(header->Name), '/');
+        name = std::string((char*)header->Name, s);
+    }
+}
+
 bool dpLibFile::loadMemory(const char *path, void *lib_data, size_t lib_size, dpTime mtime)
 {
     if(!m_objs.empty() && mtime<=m_mtime) { return true; }
@@ -440,16 +758,16 @@ bool dpLibFile::loadMemory(const char *path, void *lib_data, size_t lib_size, dp
     }
     base += IMAGE_ARCHIVE_START_SIZE;
 
-    size_t num_loaded = 0;
+    // member の発見は逐次に、ハッシュと解析は member 毎に独立しているので並列に行う
+    size_t num_loaded = 0, num_reused = 0;
     char *name_section = NULL;
     char *first_linker_member = NULL;
     char *second_linker_member = NULL;
+    member_load_cont found;
     for(; base<(char*)lib_data+lib_size; ) {
         PIMAGE_ARCHIVE_MEMBER_HEADER header = (PIMAGE_ARCHIVE_MEMBER_HEADER)base;
         base += sizeof(IMAGE_ARCHIVE_MEMBER_HEADER);
 
-        std::string name;
-        void *data = nullptr;
         DWORD32 mtime, size;
         sscanf((char*)header->Date, "%d", &mtime);
         sscanf((char*)header->Size, "%d", &size);
@@ -464,55 +782,301 @@ bool dpLibFile::loadMemory(const char *path, void *lib_data, size_t lib_size, dp
             else if(second_linker_member==NULL) { second_linker_member = base; }
         }
         else {
-            // Name が '/'+数字 の場合、その数字は long name セクションの offset 値
-            if(header->Name[0]=='/') {
-                DWORD offset;
-                sscanf((char*)header->Name+1, "%d", &offset);
-                name = name_section+offset;
-            }
-            // それ以外の場合 Name にはファイル名が入っている。null terminated ではないので注意が必要 ('/' で終わる)
-            else {
-                char *s = std::find((char*)header->Name, (char*)header->Name+sizeof(header->Name), '/');
-                name = std::string((char*)header->Name, s);
-            }
-
-            dpObjFile *old = findObjFile(name.c_str());
-            if(old && mtime<=old->getLastModifiedTime()) {
-                goto GO_NEXT;
-            }
-            else {
-                data = dpAllocateModule(size);
-                memcpy(data, base, size);
-                dpObjFile *obj = new dpObjFile(m_context);
-                if(obj->loadMemory(name.c_str(), data, size, mtime)) {
-                    if(old) {
-                        m_objs.erase(std::find(m_objs.begin(), m_objs.end(), old));
-                        delete old;
-                    }
-                    m_objs.push_back(obj);
-                    ++num_loaded;
-                }
-                else {
-                    delete obj;
-                }
-            }
+            MemberLoad ml;
+            dpGetArchiveMemberName(header, name_section, ml.name);
+            dpSanitizePath(ml.name);
+            ml.data = base;
+            ml.size = size;
+            ml.mtime = mtime;
+            ml.checksum = 0;
+            ml.obj = nullptr;
+            found.push_back(ml);
         }
 
-GO_NEXT:
         base += size;
         base = (char*)((size_t)base+1 & ~1); // 2 byte align
     }
 
+    // 変更の判定は中身で行う。lib.exe の設定によっては member の日付は当てにならない
+    dpParallelFor(found.size(), [&](size_t i){
+        found[i].checksum = dpHashBytes(found[i].data, found[i].size);
+    });
+    std::vector<size_t> to_parse;
+    for(size_t i=0; i<found.size(); ++i) {
+        MemberLoad &ml = found[i];
+        uint32_t pi = m_predecessor ? m_predecessor->findObjIndex(ml.name.c_str()) : dpNameIndex::npos;
+        if(pi!=dpNameIndex::npos && m_predecessor->m_checksums[pi]==ml.checksum) {
+            ml.obj = m_predecessor->releaseObj(pi);
+            ++num_reused;
+        }
+        else {
+            to_parse.push_back(i);
+        }
+    }
+    parseMembers(found, to_parse);
+
+    // 結果は archive 内の順に登録する (同名の symbol は先にある member のものが優先される)
+    dpEach(found, [&](MemberLoad &ml){
+        if(ml.obj==nullptr) { return; }
+        addObj(ml.obj, ml.checksum);
+        ++num_loaded;
+    });
+
     if(num_loaded) {
+        std::vector<dpSymbolTable*> tables;
+        tables.reserve(m_objs.size());
+        eachObjs([&](dpObjFile *o){ tables.push_back(&o->getSymbolTable()); });
         m_symbols.clear();
-        eachObjs([&](dpObjFile *o){
-            m_symbols.merge(o->getSymbolTable());
-        });
+        m_symbols.merge(tables.data(), tables.size());
+    }
+    if(num_reused) {
+        dpPrintDetail("%s: %d of %d members unchanged\n", m_path.c_str(), (int)num_reused, (int)m_objs.size());
     }
 
     return true;
 }
 
+// linker member から symbol 名 -> member の index を作る。
+// 先頭の特殊セクション (linker member と long name セクション) だけを読み、通常の member には触らない。
+// 第 2 linker member (ソート済み、little endian) を優先し、無ければ第 1 linker member (big endian) を使う
+bool dpLibFile::loadIndex(const char *path, const void *lib_data, size_t lib_size, dpTime mtime)
+{
+    const char *begin = (const char*)lib_data;
+    const char *end = begin + lib_size;
+    if(lib_size<IMAGE_ARCHIVE_START_SIZE || strncmp(begin, IMAGE_ARCHIVE_START, IMAGE_ARCHIVE_START_SIZE)!=0) {
+        dpPrintError("unknown file format %s\n", path);
+        return false;
+    }
+
+    const char *first_linker_member = NULL, *second_linker_member = NULL;
+    DWORD first_size = 0, second_size = 0;
+    uint32_t longnames = 0;
+    for(const char *base=begin+IMAGE_ARCHIVE_START_SIZE; base+sizeof(IMAGE_ARCHIVE_MEMBER_HEADER)<=end; ) {
+        PIMAGE_ARCHIVE_MEMBER_HEADER header = (PIMAGE_ARCHIVE_MEMBER_HEADER)base;
+        if(header->Name[0]!='/') { break; }
+        const char *data = base + sizeof(IMAGE_ARCHIVE_MEMBER_HEADER);
+        DWORD size = 0;
+        sscanf((char*)header->Size, "%d", &size);
+        if(data+size>end) { break; }
+        if(header->Name[1]=='/') {
+            longnames = (uint32_t)(data-begin);
+        }
+        else if(header->Name[1]==' ') {
+            if     (first_linker_member==NULL)  { first_linker_member = data; first_size = size; }
+            else if(second_linker_member==NULL) { second_linker_member = data; second_size = size; }
+        }
+        base = (const char*)((size_t)(data+size)+1 & ~1); // 2 byte align
+    }
+
+    member_cont members;
+    if(second_linker_member && second_size>=sizeof(DWORD)) {
+        const DWORD *offsets = (const DWORD*)second_linker_member;
+        DWORD num_members = *offsets++;
+        if(sizeof(DWORD)*(num_members+2) > second_size) { return false; }
+        DWORD num_symbols = offsets[num_members];
+        const WORD *indices = (const WORD*)(offsets+num_members+1);
+        const char *names = (const char*)(indices+num_symbols);
+        const char *names_end = second_linker_member + second_size;
+        if(names>names_end) { return false; }
+        members.reserve(num_symbols);
+        for(DWORD i=0; i<num_symbols && names<names_end; ++i) {
+            size_t len = strnlen(names, names_end-names);
+            if(indices[i]>=1 && indices[i]<=num_members) {
+                MemberIndex mi = {m_member_names.intern(names, len), offsets[indices[i]-1]};
+                members.push_back(mi);
+            }
+            names += len+1;
+        }
+    }
+    else if(first_linker_member && first_size>=sizeof(DWORD)) {
+        const DWORD *offsets = (const DWORD*)first_linker_member;
+        DWORD num_symbols = _byteswap_ulong(*offsets++);
+        if(sizeof(DWORD)*(num_symbols+1) > first_size) { return false; }
+        const char *names = (const char*)(offsets+num_symbols);
+        const char *names_end = first_linker_member + first_size;
+        members.reserve(num_symbols);
+        for(DWORD i=0; i<num_symbols && names<names_end; ++i) {
+            size_t len = strnlen(names, names_end-names);
+            MemberIndex mi = {m_member_names.intern(names, len), (uint32_t)_byteswap_ulong(offsets[i])};
+            members.push_back(mi);
+            names += len+1;
+        }
+    }
+    else {
+        return false;
+    }
+    std::stable_sort(members.begin(), members.end(),
+        [](const MemberIndex &a, const MemberIndex &b){ return strcmp(a.name, b.name)<0; });
+
+    m_path = path; dpSanitizePath(m_path);
+    m_mtime = mtime;
+    m_members.swap(members);
+    m_longnames = longnames;
+    {
+        std::vector<uint32_t> offsets;
+        offsets.reserve(m_members.size());
+        dpEach(m_members, [&](const MemberIndex &mi){ offsets.push_back(mi.offset); });
+        std::sort(offsets.begin(), offsets.end());
+        m_num_members = std::distance(offsets.begin(), std::unique(offsets.begin(), offsets.end()));
+    }
+    dpPrintDetail("%s: %d symbols of %d members indexed. members are loaded on demand\n", m_path.c_str(), (int)m_members.size(), (int)m_num_members);
+    if(m_predecessor) {
+        takeOverMembers(begin, lib_size);
+    }
+    return true;
+}
+
+// 遅延ロード時、差し替え前の lib でロード済みだった member のうち中身の変わらないものを引き継ぐ。
+// member のヘッダを順に辿り、引き継ぎ元にある名前の member だけハッシュを取る
+void dpLibFile::takeOverMembers(const char *lib_data, size_t lib_size)
+{
+    if(m_predecessor->m_objs.empty()) { return; }
+
+    const char *end = lib_data + lib_size;
+    const char *name_section = m_longnames!=0 ? lib_data+m_longnames : nullptr;
+    std::vector<dpObjFile*> reused;
+    for(const char *base=lib_data+IMAGE_ARCHIVE_START_SIZE; base+sizeof(IMAGE_ARCHIVE_MEMBER_HEADER)<=end; ) {
+        PIMAGE_ARCHIVE_MEMBER_HEADER header = (PIMAGE_ARCHIVE_MEMBER_HEADER)base;
+        const char *data = base + sizeof(IMAGE_ARCHIVE_MEMBER_HEADER);
+        DWORD size = 0;
+        sscanf((char*)header->Size, "%d", &size);
+        if(data+size>end) { break; }
+        if(header->Name[0]!='/' || (header->Name[1]!='/' && header->Name[1]!=' ')) {
+            std::string name;
+            dpGetArchiveMemberName(header, name_section, name);
+            dpSanitizePath(name);
+            uint32_t pi = m_predecessor->findObjIndex(name.c_str());
+            if(pi!=dpNameIndex::npos) {
+                uint64_t checksum = dpHashBytes(data, size);
+                if(m_predecessor->m_checksums[pi]==checksum) {
+                    dpObjFile *obj = m_predecessor->releaseObj(pi);
+                    addObj(obj, checksum);
+                    uint32_t offset = (uint32_t)(base-lib_data);
+                    m_loaded_members.insert(std::lower_bound(m_loaded_members.begin(), m_loaded_members.end(), offset), offset);
+                    reused.push_back(obj);
+                }
+            }
+        }
+        base = (const char*)((size_t)(data+size)+1 & ~1); // 2 byte align
+    }
+    mergeMemberSymbols(reused);
+    dpPrintDetail("%s: %d unchanged members taken over\n", m_path.c_str(), (int)reused.size());
+}
+
+// offset にある member のヘッダを読む
+bool dpLibFile::readMember(const char *lib_data, size_t lib_size, uint32_t offset, MemberLoad &o) const
+{
+    if((size_t)offset+sizeof(IMAGE_ARCHIVE_MEMBER_HEADER) > lib_size) { return false; }
+    PIMAGE_ARCHIVE_MEMBER_HEADER header = (PIMAGE_ARCHIVE_MEMBER_HEADER)(lib_data+offset);
+    const char *data = lib_data + offset + sizeof(IMAGE_ARCHIVE_MEMBER_HEADER);
+    DWORD32 mtime = 0, size = 0;
+    sscanf((char*)header->Date, "%d", &mtime);
+    sscanf((char*)header->Size, "%d", &size);
+    if(data+size > lib_data+lib_size) { return false; }
+
+    dpGetArchiveMemberName(header, m_longnames!=0 ? lib_data+m_longnames : nullptr, o.name);
+    dpSanitizePath(o.name);
+    o.data = data;
+    o.size = size;
+    o.mtime = mtime;
+    o.checksum = 0;
+    o.obj = nullptr;
+    return true;
+}
+
+// members[indices[i]] を並列に解析し、成功したものは obj に入れる。ハッシュもここで取る。
+// 解析中に触る共有のもの (dpCodeHeap, dpLoader::newSymbol()) はそれぞれロックされている
+void dpLibFile::parseMembers(member_load_cont &members, const std::vector<size_t> &indices)
+{
+    dpParallelFor(indices.size(), [&](size_t i){
+        MemberLoad &ml = members[indices[i]];
+        if(ml.checksum==0) {
+            ml.checksum = dpHashBytes(ml.data, ml.size);
+        }
+        dpObjFile *obj = new dpObjFile(m_context);
+        if(obj->loadView(ml.name.c_str(), ml.data, ml.size, ml.mtime)) {
+            ml.obj = obj;
+        }
+        else {
+            delete obj;
+        }
+    });
+}
+
+bool dpLibFile::hasLazyMembers() const
+{
+    return m_loaded_members.size() < m_num_members;
+}
+
+bool dpLibFile::hasLazyMemberDefining(const char *name) const
+{
+    auto less = [](const MemberIndex &a, const char *b){ return strcmp(a.name, b)<0; };
+    for(auto i=std::lower_bound(m_members.begin(), m_members.end(), name, less); i!=m_members.end() && strcmp(i->name, name)==0; ++i) {
+        if(!std::binary_search(m_loaded_members.begin(), m_loaded_members.end(), i->offset)) { return true; }
+    }
+    return false;
+}
+
+size_t dpLibFile::loadMembersDefining(const std::vector<const char*> &names, std::vector<dpObjFile*> &loaded)
+{
+    if(m_members.empty()) { return 0; }
+
+    // names も m_members もソート済みなので、並行して辿る
+    auto less = [](const MemberIndex &a, const char *b){ return strcmp(a.name, b)<0; };
+    std::vector<uint32_t> offsets;
+    auto mi = m_members.begin();
+    dpEach(names, [&](const char *name){
+        mi = std::lower_bound(mi, m_members.end(), name, less);
+        for(auto i=mi; i!=m_members.end() && strcmp(i->name, name)==0; ++i) {
+            if(!std::binary_search(m_loaded_members.begin(), m_loaded_members.end(), i->offset)) {
+                offsets.push_back(i->offset);
+            }
+        }
+    });
+    if(offsets.empty()) { return 0; }
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+
+    if(dpGetMTime(m_path.c_str())!=m_mtime) {
+        dpPrintWarning("%s has been modified since loaded. members cannot be loaded until reloaded\n", m_path.c_str());
+        return 0;
+    }
+    const void *view;
+    size_t size;
+    if(!dpMapFileView(m_path.c_str(), view, size)) {
+        dpPrintError("file not found %s\n", m_path.c_str());
+        return 0;
+    }
+    member_load_cont members(offsets.size());
+    std::vector<size_t> indices;
+    for(size_t i=0; i<offsets.size(); ++i) {
+        // 失敗した member も何度も試さないようロード済みにしておく
+        m_loaded_members.insert(std::lower_bound(m_loaded_members.begin(), m_loaded_members.end(), offsets[i]), offsets[i]);
+        if(readMember((const char*)view, size, offsets[i], members[i])) {
+            indices.push_back(i);
+        }
+    }
+    parseMembers(members, indices);
+    size_t num_loaded = 0;
+    dpEach(indices, [&](size_t i){
+        if(dpObjFile *obj = members[i].obj) {
+            addObj(obj, members[i].checksum);
+            loaded.push_back(obj);
+            ++num_loaded;
+        }
+    });
+    dpUnmapFileView(view);
+    return num_loaded;
+}
+
+void dpLibFile::mergeMemberSymbols(const std::vector<dpObjFile*> &objs)
+{
+    std::vector<dpSymbolTable*> tables;
+    tables.reserve(objs.size());
+    dpEach(objs, [&](dpObjFile *o){ tables.push_back(&o->getSymbolTable()); });
+    m_symbols.merge(tables.data(), tables.size());
+}
+
 bool dpLibFile::link()
 {
     bool ret = true;
@@ -520,6 +1084,23 @@ bool dpLibFile::link()
     return ret;
 }
 
+void dpLibFile::eachUndefinedSymbols(const std::function<void (const char*)> &f)
+{
+    eachObjs([&](dpObjFile *o){ o->eachUndefinedSymbols(f); });
+}
+
+void dpLibFile::resolveUndefinedSymbols(const std::function<const dpSymbol* (const char*)> &resolver)
+{
+    eachObjs([&](dpObjFile *o){ o->resolveUndefinedSymbols(resolver); });
+}
+
+bool dpLibFile::invalidateLink(const std::function<bool (const dpBinary*, const char*)> &is_stale, const std::function<bool (const char*)> &is_resolvable)
+{
+    bool ret = false;
+    eachObjs([&](dpObjFile *o){ if(o->invalidateLink(is_stale, is_resolvable)) { ret=true; } });
+    return ret;
+}
+
 bool dpLibFile::partialLink(size_t section)
 {
     return true;
@@ -538,12 +1119,40 @@ size_t         dpLibFile::getNumObjFiles() const      { return m_objs.size(); }
 dpObjFile*     dpLibFile::getObjFile(size_t i)        { return m_objs[i]; }
 dpObjFile* dpLibFile::findObjFile( const char *name )
 {
-    dpObjFile *ret = nullptr;
-    eachObjs([&](dpObjFile *o){
-        if(_stricmp(o->getPath(), name)==0) {
-            ret = o;
-        }
+    uint32_t i = findObjIndex(name);
+    return i!=dpNameIndex::npos ? m_objs[i] : nullptr;
+}
+
+uint32_t dpLibFile::findObjIndex(const char *name) const
+{
+    std::string path = name;
+    dpSanitizePath(path);
+    return m_obj_index.find(dpHashMemberName(name), [&](uint32_t i){
+        return _stricmp(m_objs[i]->getPath(), path.c_str())==0;
     });
+}
+
+void dpLibFile::addObj(dpObjFile *obj, uint64_t checksum)
+{
+    m_obj_index.insert(dpHashMemberName(obj->getPath()), (uint32_t)m_objs.size());
+    m_objs.push_back(obj);
+    m_checksums.push_back(checksum);
+}
+
+// i 番目の obj を所有から外して返す。空いた位置には末尾の obj を移す
+dpObjFile* dpLibFile::releaseObj(uint32_t i)
+{
+    dpObjFile *ret = m_objs[i];
+    uint32_t last = (uint32_t)m_objs.size()-1;
+    m_obj_index.erase(dpHashMemberName(ret->getPath()), i);
+    if(i!=last) {
+        m_obj_index.erase(dpHashMemberName(m_objs[last]->getPath()), last);
+        m_objs[i] = m_objs[last];
+        m_checksums[i] = m_checksums[last];
+        m_obj_index.insert(dpHashMemberName(m_objs[i]->getPath()), i);
+    }
+    m_objs.pop_back();
+    m_checksums.pop_back();
     return ret;
 }
 
@@ -551,7 +1160,7 @@ dpObjFile* dpLibFile::findObjFile( const char *name )
 
 dpDllFile::dpDllFile(dpContext *ctx)
     : dpBinary(ctx)
-    , m_module(nullptr), m_needs_freelibrary(false)
+    , m_module(nullptr), m_exports(nullptr), m_needs_freelibrary(false)
     , m_mtime(0)
 {
 }
@@ -570,29 +1179,38 @@ void dpDllFile::unload()
         dpDeleteFile(m_actual_file.c_str()); m_actual_file.clear();
         dpDeleteFile(m_pdb_path.c_str()); m_pdb_path.clear();
     }
+    m_exports = nullptr;
     m_needs_freelibrary = false;
     m_symbols.clear();
 }
 
-// F: functor(const char *name, void *sym)
-template<class F>
-inline void dpEnumerateDLLExports(HMODULE module, const F &f)
+inline IMAGE_EXPORT_DIRECTORY* dpGetExportDirectory(HMODULE module)
 {
-    if(module==NULL) { return; }
+    if(module==NULL) { return nullptr; }
 
     size_t ImageBase = (size_t)module;
     PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)ImageBase;
-    if(pDosHeader->e_magic!=IMAGE_DOS_SIGNATURE) { return; }
+    if(pDosHeader->e_magic!=IMAGE_DOS_SIGNATURE) { return nullptr; }
 
     PIMAGE_NT_HEADERS pNTHeader = (PIMAGE_NT_HEADERS)(ImageBase + pDosHeader->e_lfanew);
     DWORD RVAExports = pNTHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress;
-    if(RVAExports==0) { return; }
+    if(RVAExports==0) { return nullptr; }
+    return (IMAGE_EXPORT_DIRECTORY *)(ImageBase + RVAExports);
+}
+
+// F: functor(const char *name, void *sym)
+template<class F>
+inline void dpEnumerateDLLExports(HMODULE module, const F &f)
+{
+    IMAGE_EXPORT_DIRECTORY *pExportDirectory = dpGetExportDirectory(module);
+    if(pExportDirectory==nullptr) { return; }
 
-    IMAGE_EXPORT_DIRECTORY *pExportDirectory = (IMAGE_EXPORT_DIRECTORY *)(ImageBase + RVAExports);
+    size_t ImageBase = (size_t)module;
     DWORD *RVANames = (DWORD*)(ImageBase+pExportDirectory->AddressOfNames);
     WORD *RVANameOrdinals = (WORD*)(ImageBase+pExportDirectory->AddressOfNameOrdinals);
     DWORD *RVAFunctions = (DWORD*)(ImageBase+pExportDirectory->AddressOfFunctions);
-    for(DWORD i=0; i<pExportDirectory->NumberOfFunctions; ++i) {
+    // 名前の表は名前付きの export の分だけ (序数だけの export は含まない)
+    for(DWORD i=0; i<pExportDirectory->NumberOfNames; ++i) {
         char *pName = (char*)(ImageBase+RVANames[i]);
         void *pFunc = (void*)(ImageBase+RVAFunctions[RVANameOrdinals[i]]);
         f(pName, pFunc);
@@ -802,6 +1420,13 @@ bool dpDllFile::loadMemory(const char *path, void *data, size_t /*datasize*/, dp
     m_path = path; dpSanitizePath(m_path);
     m_mtime = mtime;
     m_module = (HMODULE)data;
+    m_exports = nullptr;
+    if((dpGetConfig().sys_flags&dpE_SysLazyDllExports)!=0) {
+        // 全 export を列挙せず、問い合わせのあった名前だけ findExport() で symbol にする。
+        // module はロードしたままなので、名前の表はそのまま検索に使える
+        m_exports = dpGetExportDirectory(m_module);
+        return true;
+    }
     dpEnumerateDLLExports(m_module, [&](const char *name, void *sym){
         m_symbols.addSymbol(dpGetLoader()->newSymbol(name, sym, dpE_Code|dpE_Read|dpE_Execute|dpE_Export, 0, this));
     });
@@ -811,9 +1436,23 @@ bool dpDllFile::loadMemory(const char *path, void *data, size_t /*datasize*/, dp
 
 bool dpDllFile::link() { return m_module!=nullptr; }
 bool dpDllFile::partialLink(size_t section) { return m_module!=nullptr; }
+void dpDllFile::eachUndefinedSymbols(const std::function<void (const char*)> &f) {}
+void dpDllFile::resolveUndefinedSymbols(const std::function<const dpSymbol* (const char*)> &resolver) {}
+bool dpDllFile::invalidateLink(const std::function<bool (const dpBinary*, const char*)> &is_stale, const std::function<bool (const char*)> &is_resolvable) { return false; }
 
 bool dpDllFile::callHandler( dpEventType e )
 {
+    if(m_exports) {
+        // handler を呼ぶためだけに symbol を作ることはしない
+        const char *name = nullptr;
+        switch(e) {
+        case dpE_OnLoad:   name = g_symname_onload;   break;
+        case dpE_OnUnload: name = g_symname_onunload; break;
+        default: return false;
+        }
+        if(void *f = findExportAddress(name)) { ((dpEventHandler)f)(); }
+        return true;
+    }
     switch(e) {
     case dpE_OnLoad:   dpCallOnLoadHandler(this);   return true;
     case dpE_OnUnload: dpCallOnUnloadHandler(this); return true;
@@ -821,6 +1460,58 @@ bool dpDllFile::callHandler( dpEventType e )
     return false;
 }
 
+// 名前の表は名前順に並んでいる (PE の仕様) ので二分探索で引ける
+static DWORD dpFindExportIndex(HMODULE module, const IMAGE_EXPORT_DIRECTORY *exports, const char *name)
+{
+    size_t ImageBase = (size_t)module;
+    const DWORD *RVANames = (const DWORD*)(ImageBase+exports->AddressOfNames);
+    DWORD lo = 0, hi = exports->NumberOfNames;
+    while(lo<hi) {
+        DWORD mid = lo + (hi-lo)/2;
+        int c = strcmp((const char*)(ImageBase+RVANames[mid]), name);
+        if(c==0)     { return mid; }
+        else if(c<0) { lo = mid+1; }
+        else         { hi = mid; }
+    }
+    return (DWORD)-1;
+}
+
+static void* dpGetExportAddress(HMODULE module, const IMAGE_EXPORT_DIRECTORY *exports, DWORD i)
+{
+    size_t ImageBase = (size_t)module;
+    const WORD *RVANameOrdinals = (const WORD*)(ImageBase+exports->AddressOfNameOrdinals);
+    const DWORD *RVAFunctions = (const DWORD*)(ImageBase+exports->AddressOfFunctions);
+    return (void*)(ImageBase+RVAFunctions[RVANameOrdinals[i]]);
+}
+
+bool dpDllFile::hasLazyExports() const
+{
+    return m_exports!=nullptr;
+}
+
+dpSymbol* dpDllFile::findExport(const char *name)
+{
+    if(m_exports==nullptr) { return nullptr; }
+    if(dpSymbol *sym = m_symbols.peekSymbolByName(name)) { return sym; }
+
+    DWORD i = dpFindExportIndex(m_module, m_exports, name);
+    if(i==(DWORD)-1) { return nullptr; }
+    // 名前は module 内のものを使う (module はアンロードまで残る)
+    const DWORD *RVANames = (const DWORD*)((size_t)m_module+m_exports->AddressOfNames);
+    const char *exported = (const char*)((size_t)m_module+RVANames[i]);
+    dpSymbol *sym = dpGetLoader()->newSymbol(exported, dpGetExportAddress(m_module, m_exports, i), dpE_Code|dpE_Read|dpE_Execute|dpE_Export, 0, this);
+    m_symbols.addSymbol(sym);
+    m_symbols.mergePending(false);
+    return sym;
+}
+
+void* dpDllFile::findExportAddress(const char *name) const
+{
+    if(m_exports==nullptr) { return nullptr; }
+    DWORD i = dpFindExportIndex(m_module, m_exports, name);
+    return i!=(DWORD)-1 ? dpGetExportAddress(m_module, m_exports, i) : nullptr;
+}
+
 dpSymbolTable& dpDllFile::getSymbolTable()            { return m_symbols; }
 const char*    dpDllFile::getPath() const             { return m_path.c_str(); }
 dpTime         dpDllFile::getLastModifiedTime() const { return m_mtime; }
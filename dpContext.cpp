@@ -38,16 +38,21 @@ size_t dpContext::load(const char *path)
 size_t dpContext::patchByFile(const char *filename, const char *filter_regex)
 {
     if(dpBinary *bin=m_loader->findBinary(filename)) {
-        std::regex reg(filter_regex);
-        m_patcher->patchByBinary(bin,
-            [&](const dpSymbolS &sym){
-                return std::regex_search(sym.name, reg);
-        });
+        m_patcher->patchByBinary(bin, getSymbolFilter(filter_regex));
         return true;
     }
     return false;
 }
 
+const dpSymbolFilter& dpContext::getSymbolFilter(const char *pattern)
+{
+    auto i = m_filters.find(pattern);
+    if(i==m_filters.end()) {
+        i = m_filters.insert(std::make_pair(std::string(pattern), dpSymbolFilter(pattern))).first;
+    }
+    return i->second;
+}
+
 size_t dpContext::patchByFile(const char *filename, const std::function<bool (const dpSymbolS&)> &condition)
 {
     if(dpBinary *bin=m_loader->findBinary(filename)) {
@@ -121,3 +126,11 @@ void dpContext::addForceHostSymbolPattern(const char *pattern)
 {
     m_loader->addForceHostSymbolPattern(pattern);
 }
+
+const dpSymbolS* dpContext::findSymbolByAddress(void *addr)
+{
+    if(dpSymbol *sym=m_loader->findSymbolContainingAddress(addr)) {
+        return &sym->simplify();
+    }
+    return nullptr;
+}
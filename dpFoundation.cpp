@@ -125,9 +125,26 @@ void* dpAllocateModule(size_t size)
     return dpAllocateBackward(size, GetModuleHandleA(nullptr));
 }
 
+// VirtualAlloc() は 64kb 単位でしか align されないので、大きめに予約して align された位置を調べた後、
+// 一旦解放してその位置に確保し直す。間に他のスレッドに取られた場合はリトライ。
+void* dpAllocateAligned(size_t size, size_t align)
+{
+    if(size==0) { return NULL; }
+    void *ret = NULL;
+    for(int i=0; ret==NULL && i<16; ++i) {
+        void *reserved = ::VirtualAlloc(NULL, size+align, MEM_RESERVE, PAGE_NOACCESS);
+        if(reserved==NULL) { break; }
+        size_t aligned = ((size_t)reserved + align-1) & ~(align-1);
+        ::VirtualFree(reserved, 0, MEM_RELEASE);
+        ret = ::VirtualAlloc((void*)aligned, size, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+    }
+    return ret;
+}
+
 void dpDeallocate(void *location, size_t size)
 {
-    ::VirtualFree(location, size, MEM_RELEASE);
+    // MEM_RELEASE の場合サイズは 0 でなければならない (確保した領域全体が解放される)
+    ::VirtualFree(location, 0, MEM_RELEASE);
 }
 
 dpTime dpGetMTime(const char *path)
@@ -176,6 +193,32 @@ bool dpDeleteFile(const char *path)
     return ::DeleteFileA(path)==TRUE;
 }
 
+bool dpMapFileView(const char *path, const void *&o_data, size_t &o_size)
+{
+    o_data = NULL;
+    o_size = 0;
+    // map している間もコンパイラなどが書き換えようとする可能性があるので、共有は全て許可しておく
+    HANDLE file = ::CreateFileA(path, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file==INVALID_HANDLE_VALUE) { return false; }
+
+    LARGE_INTEGER size;
+    if(::GetFileSizeEx(file, &size) && size.QuadPart>0) {
+        if(HANDLE mapping = ::CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL)) {
+            // view が mapping と file を参照し続けるので、handle はここで閉じてよい
+            o_data = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if(o_data!=NULL) { o_size = (size_t)size.QuadPart; }
+            ::CloseHandle(mapping);
+        }
+    }
+    ::CloseHandle(file);
+    return o_data!=NULL;
+}
+
+void dpUnmapFileView(const void *data)
+{
+    if(data!=NULL) { ::UnmapViewOfFile(data); }
+}
+
 bool dpFileExists( const char *path )
 {
     return ::GetFileAttributesA(path)!=INVALID_FILE_ATTRIBUTES;
@@ -225,16 +268,52 @@ void dpSanitizePath(std::string &path)
     });
 }
 
+struct dpParallelForContext
+{
+    const std::function<void (size_t)> *func;
+    size_t num;
+    volatile LONG next;
+};
+
+static unsigned __stdcall dpParallelForWorker(void *arg)
+{
+    dpParallelForContext &ctx = *(dpParallelForContext*)arg;
+    for(;;) {
+        size_t i = (size_t)(::InterlockedIncrement(&ctx.next)-1);
+        if(i>=ctx.num) { break; }
+        (*ctx.func)(i);
+    }
+    return 0;
+}
+
+void dpParallelFor(size_t n, const std::function<void (size_t)> &f)
+{
+    if(n==0) { return; }
+    SYSTEM_INFO info;
+    ::GetSystemInfo(&info);
+    size_t num_threads = std::min<size_t>(info.dwNumberOfProcessors, n);
+
+    dpParallelForContext ctx = {&f, n, 0};
+    // 呼び出し元のスレッドも処理に参加するので、作るのは num_threads-1 個
+    std::vector<HANDLE> threads;
+    for(size_t i=1; i<num_threads; ++i) {
+        HANDLE h = (HANDLE)_beginthreadex(nullptr, 0, &dpParallelForWorker, &ctx, 0, nullptr);
+        if(h!=nullptr) { threads.push_back(h); }
+    }
+    dpParallelForWorker(&ctx);
+    dpEach(threads, [](HANDLE h){
+        ::WaitForSingleObject(h, INFINITE);
+        ::CloseHandle(h);
+    });
+}
 
 
-dpSymbol::dpSymbol(const char *nam, void *addr, int fla, int sect, dpBinary *bin)
-    : name(nam), address(addr), flags(fla), section(sect), binary(bin)
+
+dpSymbol::dpSymbol(const char *nam, void *addr, int fla, int sect, dpBinary *bin, size_t siz)
+    : name(nam), address(addr), flags(fla), section(sect), binary(bin), size(siz)
 {}
 dpSymbol::~dpSymbol()
 {
-    if((flags&dpE_NameNeedsDelete)!=0) {
-        delete[] name;
-    }
 }
 const dpSymbolS& dpSymbol::simplify() const { return (const dpSymbolS&)*this; }
 bool dpSymbol::partialLink() { return binary->partialLink(section); }
@@ -390,6 +469,9 @@ dpTrampolineAllocator::Page* dpTrampolineAllocator::findCandidatePage(void *loca
 
 
 
+// page は page_size に align して確保し、先頭にこのヘッダを置く。
+// そのため block のアドレスをマスクするだけで所属する page の候補が求まる。
+// 他所で確保されたアドレスの場合はそこが未確保の領域でありうるので、ヘッダを読む前に m_pages にあるか調べる。
 template<size_t PageSize, size_t BlockSize>
 class dpBlockAllocator<PageSize, BlockSize>::Page
 {
@@ -400,34 +482,54 @@ public:
             Block *next;
         };
     };
-    Page();
-    ~Page();
+    static Page* create();
+    static void destroy(Page *p);
+    static Page* findOwnerPage(void *v);
     void* allocate();
-    bool deallocate(void *v);
-    bool isInsideMemory(void *p) const;
+    void deallocate(void *v);
+    bool isFull() const;
+    bool isEmpty() const;
+
+    Page *prev;
+    Page *next;
 
 private:
-    void *m_data;
     Block *m_freelist;
+    char  *m_unused; // まだ一度も使われていない領域の先頭。page 作成時に全 block を触らないため
+    size_t m_num_used;
+
+    Page();
+    char* getEnd() const;
 };
 
 template<size_t PageSize, size_t BlockSize>
 dpBlockAllocator<PageSize, BlockSize>::Page::Page()
-    : m_data(nullptr), m_freelist(nullptr)
+    : prev(nullptr), next(nullptr), m_freelist(nullptr), m_num_used(0)
 {
-    m_data = malloc(page_size);
-    m_freelist = (Block*)m_data;
-    size_t n = page_size / block_size;
-    for(size_t i=0; i<n-1; ++i) {
-        m_freelist[i].next = m_freelist+i+1;
-    }
-    m_freelist[n-1].next = nullptr;
+    // block は 16 byte 境界から並べる
+    size_t header_size = (sizeof(Page)+15) & ~15;
+    m_unused = (char*)this + header_size;
+}
+
+template<size_t PageSize, size_t BlockSize>
+typename dpBlockAllocator<PageSize, BlockSize>::Page* dpBlockAllocator<PageSize, BlockSize>::Page::create()
+{
+    void *mem = dpAllocateAligned(page_size, page_size);
+    if(mem==nullptr) { return nullptr; }
+    return new(mem) Page();
+}
+
+template<size_t PageSize, size_t BlockSize>
+void dpBlockAllocator<PageSize, BlockSize>::Page::destroy(Page *p)
+{
+    p->~Page();
+    dpDeallocate(p, page_size);
 }
 
 template<size_t PageSize, size_t BlockSize>
-dpBlockAllocator<PageSize, BlockSize>::Page::~Page()
+typename dpBlockAllocator<PageSize, BlockSize>::Page* dpBlockAllocator<PageSize, BlockSize>::Page::findOwnerPage(void *v)
 {
-    free(m_data);
+    return (Page*)((size_t)v & ~(page_size-1));
 }
 
 template<size_t PageSize, size_t BlockSize>
@@ -438,99 +540,626 @@ void* dpBlockAllocator<PageSize, BlockSize>::Page::allocate()
         ret = m_freelist;
         m_freelist = m_freelist->next;
     }
+    else if(m_unused+block_size <= getEnd()) {
+        ret = m_unused;
+        m_unused += block_size;
+    }
+    if(ret) { ++m_num_used; }
     return ret;
 }
 
 template<size_t PageSize, size_t BlockSize>
-bool dpBlockAllocator<PageSize, BlockSize>::Page::deallocate(void *v)
+void dpBlockAllocator<PageSize, BlockSize>::Page::deallocate(void *v)
 {
-    if(v==nullptr) { return false; }
-    bool ret = false;
-    if(isInsideMemory(v)) {
-        Block *b = (Block*)v;
-        b->next = m_freelist;
-        m_freelist = b;
-        ret = true;
-    }
-    return ret;
+    Block *b = (Block*)v;
+    b->next = m_freelist;
+    m_freelist = b;
+    --m_num_used;
 }
 
 template<size_t PageSize, size_t BlockSize>
-bool dpBlockAllocator<PageSize, BlockSize>::Page::isInsideMemory(void *p) const
+bool dpBlockAllocator<PageSize, BlockSize>::Page::isFull() const
 {
-    size_t loc = (size_t)p;
-    size_t base = (size_t)m_data;
-    return loc>=base && loc<base+page_size;
+    return m_freelist==nullptr && m_unused+block_size > getEnd();
+}
+
+template<size_t PageSize, size_t BlockSize>
+bool dpBlockAllocator<PageSize, BlockSize>::Page::isEmpty() const
+{
+    return m_num_used==0;
+}
+
+template<size_t PageSize, size_t BlockSize>
+char* dpBlockAllocator<PageSize, BlockSize>::Page::getEnd() const
+{
+    return (char*)this + page_size;
 }
 
 
 template<size_t PageSize, size_t BlockSize>
 dpBlockAllocator<PageSize, BlockSize>::dpBlockAllocator()
+    : m_free_pages(nullptr), m_full_pages(nullptr), m_num_free_pages(0)
 {
 }
 
 template<size_t PageSize, size_t BlockSize>
 dpBlockAllocator<PageSize, BlockSize>::~dpBlockAllocator()
 {
-    dpEach(m_pages, [](Page *p){ delete p; });
+    dpEach(m_pages, [](Page *p){ Page::destroy(p); });
     m_pages.clear();
+    m_free_pages = m_full_pages = nullptr;
+    m_num_free_pages = 0;
 }
 
 template<size_t PageSize, size_t BlockSize>
 void* dpBlockAllocator<PageSize, BlockSize>::allocate()
 {
-    for(size_t i=0; i<m_pages.size(); ++i) {
-        if(void *ret=m_pages[i]->allocate()) {
-            return ret;
-        }
+    if(m_free_pages==nullptr) {
+        Page *p = Page::create();
+        if(p==nullptr) { return nullptr; }
+        m_pages.insert(std::lower_bound(m_pages.begin(), m_pages.end(), p), p);
+        link(m_free_pages, p);
+        ++m_num_free_pages;
     }
 
-    Page *p = new Page();
-    m_pages.push_back(p);
-    return p->allocate();
+    Page *p = m_free_pages;
+    void *ret = p->allocate();
+    if(p->isFull()) {
+        unlink(m_free_pages, p);
+        --m_num_free_pages;
+        link(m_full_pages, p);
+    }
+    return ret;
 }
 
 template<size_t PageSize, size_t BlockSize>
 bool dpBlockAllocator<PageSize, BlockSize>::deallocate(void *v)
 {
-    auto p = dpFind(m_pages, [=](const Page *p){ return p->isInsideMemory(v); });
-    if(p!=m_pages.end()) {
-        (*p)->deallocate(v);
-        return true;
+    if(v==nullptr) { return false; }
+    Page *p = Page::findOwnerPage(v);
+    auto pi = std::lower_bound(m_pages.begin(), m_pages.end(), p);
+    if(pi==m_pages.end() || *pi!=p) { return false; }
+
+    if(p->isFull()) {
+        unlink(m_full_pages, p);
+        link(m_free_pages, p);
+        ++m_num_free_pages;
     }
-    return false;
+    p->deallocate(v);
+    // 空になった page は OS に返す。確保と解放を繰り返す場合に備え、空きのある page が他に無ければ残しておく
+    if(p->isEmpty() && m_num_free_pages>1) {
+        unlink(m_free_pages, p);
+        --m_num_free_pages;
+        m_pages.erase(pi);
+        Page::destroy(p);
+    }
+    return true;
+}
+
+template<size_t PageSize, size_t BlockSize>
+void dpBlockAllocator<PageSize, BlockSize>::link(Page *&list, Page *p)
+{
+    p->prev = nullptr;
+    p->next = list;
+    if(list) { list->prev = p; }
+    list = p;
+}
+
+template<size_t PageSize, size_t BlockSize>
+void dpBlockAllocator<PageSize, BlockSize>::unlink(Page *&list, Page *p)
+{
+    if(p->prev) { p->prev->next = p->next; }
+    else        { list = p->next; }
+    if(p->next) { p->next->prev = p->prev; }
+    p->prev = p->next = nullptr;
 }
 template dpBlockAllocator<1024*256, sizeof(dpSymbol)>;
 
 
-dpSymbolTable::dpSymbolTable() : m_partial_link(false)
+static dpCodeHeap g_codeheap;
+dpCodeHeap& dpGetCodeHeap() { return g_codeheap; }
+
+dpCodeHeap::dpCodeHeap()
+{
+    for(size_t i=0; i<num_classes; ++i) {
+        SizeClass &c = m_classes[i];
+        c.freelist = nullptr;
+        c.bump = c.bump_end = nullptr;
+        c.num_chunks = c.num_blocks = 0;
+    }
+}
+
+// プロセス終了時に解放されるので、ここでは何もしない
+// (他の static なオブジェクトの破棄から deallocate() が呼ばれても問題ないように、メモリは残しておく)
+dpCodeHeap::~dpCodeHeap()
 {
 }
 
+void* dpCodeHeap::allocate(size_t size, size_t align, void *location)
+{
+    if(size==0) { return nullptr; }
+    dpMutex::ScopedLock lock(m_mutex);
+
+    // chunk は 64kb 境界に確保されるので、2 の n 乗の block は block_size に align される
+    size_t ci = 0;
+    size_t block_size = min_block_size;
+    while(block_size<size || block_size<align) { block_size*=2; ++ci; }
+    if(ci>=num_classes) {
+        void *ret = dpAllocateForward(size, location);
+        if(ret) { m_large[ret] = size; }
+        return ret;
+    }
+
+    SizeClass &c = m_classes[ci];
+    void *ret = nullptr;
+    if(c.freelist) {
+        ret = c.freelist;
+        c.freelist = c.freelist->next;
+        memset(ret, 0, block_size);
+    }
+    else {
+        if(c.bump==c.bump_end) {
+            char *chunk = (char*)dpAllocateForward(chunk_size, location);
+            if(chunk==nullptr) { return nullptr; }
+            Chunk cd = {(uint32_t)ci, 0};
+            m_chunks[(size_t)chunk] = cd;
+            c.bump = chunk;
+            c.bump_end = chunk + chunk_size;
+            ++c.num_chunks;
+        }
+        // 一度も使われていない領域は VirtualAlloc() された時点のまま 0
+        ret = c.bump;
+        c.bump += block_size;
+    }
+    ++m_chunks[(size_t)ret & ~(chunk_size-1)].num_used;
+    ++c.num_blocks;
+    return ret;
+}
+
+void* dpCodeHeap::allocateDemandZero(size_t size, size_t align, void *location)
+{
+    // memset() で全ページを触ることになるので、小さいものだけ size class から取る
+    if(size < chunk_size/4) {
+        return allocate(size, align, location);
+    }
+    dpMutex::ScopedLock lock(m_mutex);
+    // VirtualAlloc() の結果は 64kb 境界なので align は常に満たされる
+    void *ret = dpAllocateForward(size, location);
+    if(ret) { m_large[ret] = size; }
+    return ret;
+}
+
+void dpCodeHeap::deallocate(void *p)
+{
+    if(p==nullptr) { return; }
+    dpMutex::ScopedLock lock(m_mutex);
+
+    auto chunk = m_chunks.find((size_t)p & ~(chunk_size-1));
+    if(chunk==m_chunks.end()) {
+        // size class に収まらなかったもの。allocate() で確保されたものでなくても VirtualFree() する
+        m_large.erase(p);
+        dpDeallocate(p, 0);
+        return;
+    }
+    SizeClass &c = m_classes[chunk->second.size_class];
+    FreeBlock *b = (FreeBlock*)p;
+    b->next = c.freelist;
+    c.freelist = b;
+    --c.num_blocks;
+    if(--chunk->second.num_used==0) {
+        releaseChunk(chunk);
+    }
+}
+
+// 空になった chunk を OS に返す。切り出し中の chunk は残しておく
+void dpCodeHeap::releaseChunk(chunk_cont::iterator chunk)
+{
+    char *begin = (char*)chunk->first;
+    char *end = begin + chunk_size;
+    SizeClass &c = m_classes[chunk->second.size_class];
+    if(c.bump>=begin && c.bump<end) { return; }
+
+    FreeBlock **pp = &c.freelist;
+    while(*pp) {
+        if((char*)*pp>=begin && (char*)*pp<end) { *pp = (*pp)->next; }
+        else { pp = &(*pp)->next; }
+    }
+    --c.num_chunks;
+    m_chunks.erase(chunk);
+    dpDeallocate(begin, chunk_size);
+}
+
+void dpCodeHeap::getStats(Stats &o) const
+{
+    dpMutex::ScopedLock lock(m_mutex);
+    o.num_large = m_large.size();
+    o.large_size = 0;
+    dpEach(m_large, [&](const std::pair<void* const, size_t> &l){ o.large_size += l.second; });
+    o.reserved_size = m_chunks.size()*chunk_size + o.large_size;
+    for(size_t i=0; i<num_classes; ++i) {
+        o.classes[i].block_size = min_block_size << i;
+        o.classes[i].num_chunks = m_classes[i].num_chunks;
+        o.classes[i].num_blocks = m_classes[i].num_blocks;
+    }
+}
+
+
+// FNV-1a
+uint32_t dpHashName(const char *name)
+{
+    uint32_t h = 2166136261U;
+    for(const char *c=name; *c!='\0'; ++c) {
+        h = (h ^ (uint8_t)*c) * 16777619U;
+    }
+    return h;
+}
+
+uint32_t dpHashName(const char *name, size_t len)
+{
+    uint32_t h = 2166136261U;
+    for(size_t i=0; i<len; ++i) {
+        h = (h ^ (uint8_t)name[i]) * 16777619U;
+    }
+    return h;
+}
+
+
+dpNameIndex::dpNameIndex() : m_size(0), m_mask(0)
+{
+}
+
+void dpNameIndex::clear()
+{
+    m_slots.clear();
+    m_size = 0;
+    m_mask = 0;
+}
+
+void dpNameIndex::reserve(size_t n)
+{
+    // 負荷率が 1/2 を超えないようにする
+    size_t capacity = 16;
+    while(capacity < n*2) { capacity *= 2; }
+    if(capacity > m_slots.size()) {
+        rehash(capacity);
+    }
+}
+
+void dpNameIndex::insert(uint32_t hash, uint32_t index)
+{
+    reserve(m_size+1);
+    size_t i = hash&m_mask;
+    while(m_slots[i].index!=npos) { i=(i+1)&m_mask; }
+    m_slots[i].hash = hash;
+    m_slots[i].index = index;
+    ++m_size;
+}
+
+bool dpNameIndex::erase(uint32_t hash, uint32_t index)
+{
+    if(m_slots.empty()) { return false; }
+    size_t i = hash&m_mask;
+    for(;;) {
+        if(m_slots[i].index==npos) { return false; }
+        if(m_slots[i].index==index) { break; }
+        i=(i+1)&m_mask;
+    }
+
+    // tombstone を使わず、後続の要素を詰めることで探査列を維持する
+    for(size_t j=(i+1)&m_mask; m_slots[j].index!=npos; j=(j+1)&m_mask) {
+        size_t home = m_slots[j].hash&m_mask;
+        if(((j-home)&m_mask) >= ((j-i)&m_mask)) {
+            m_slots[i] = m_slots[j];
+            i = j;
+        }
+    }
+    m_slots[i].index = npos;
+    --m_size;
+    return true;
+}
+
+size_t dpNameIndex::size() const { return m_size; }
+
+void dpNameIndex::rehash(size_t capacity)
+{
+    slot_cont old;
+    old.swap(m_slots);
+    Slot empty = {0, npos};
+    m_slots.resize(capacity, empty);
+    m_mask = capacity-1;
+    m_size = 0;
+    dpEach(old, [&](const Slot &s){
+        if(s.index!=npos) { insert(s.hash, s.index); }
+    });
+}
+
+
+dpStringArena::dpStringArena(size_t chunk_size)
+    : m_chunk_size(chunk_size), m_cur(nullptr), m_cur_left(0)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+dpStringArena::~dpStringArena()
+{
+    clear();
+}
+
+const char* dpStringArena::intern(const char *str)
+{
+    return intern(str, strlen(str));
+}
+
+const char* dpStringArena::intern(const char *str, size_t len)
+{
+    ++m_stats.num_requests;
+    uint32_t hash = dpHashName(str, len);
+    uint32_t i = m_index.find(hash, [&](uint32_t si){
+        const char *s = m_strings[si];
+        return strncmp(s, str, len)==0 && s[len]=='\0';
+    });
+    if(i!=dpNameIndex::npos) { return m_strings[i]; }
+
+    char *ret = allocate(len+1);
+    memcpy(ret, str, len);
+    ret[len] = '\0';
+    m_index.insert(hash, (uint32_t)m_strings.size());
+    m_strings.push_back(ret);
+    ++m_stats.num_strings;
+    m_stats.used_bytes += len+1;
+    return ret;
+}
+
+void dpStringArena::clear()
+{
+    dpEach(m_chunks, [](char *c){ free(c); });
+    m_chunks.clear();
+    m_strings.clear();
+    m_index.clear();
+    m_cur = nullptr;
+    m_cur_left = 0;
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+const dpStringArena::Stats& dpStringArena::getStats() const
+{
+    return m_stats;
+}
+
+char* dpStringArena::allocate(size_t size)
+{
+    if(size > m_cur_left) {
+        // chunk に収まらない長さの文字列は専用の chunk に置く
+        size_t csize = size > m_chunk_size ? size : m_chunk_size;
+        char *c = (char*)malloc(csize);
+        m_chunks.push_back(c);
+        m_stats.reserved_bytes += csize;
+        if(csize > m_chunk_size) { return c; }
+        m_cur = c;
+        m_cur_left = csize;
+    }
+    char *ret = m_cur;
+    m_cur += size;
+    m_cur_left -= size;
+    return ret;
+}
+
+
+// order の順に並べ替える。空の列はそのまま
+template<class Cont>
+static void dpPermute(Cont &v, const std::vector<uint32_t> &order)
+{
+    if(v.empty()) { return; }
+    Cont r;
+    r.reserve(order.size());
+    for(size_t i=0; i<order.size(); ++i) { r.push_back(v[order[i]]); }
+    v.swap(r);
+}
+
+dpSymbolTable::dpSymbolTable()
+    : m_num_sorted(0), m_ranges_dirty(false), m_partial_link(false), m_record_loader(nullptr)
+{
+}
+
+dpSymbolTable::~dpSymbolTable()
+{
+    clear();
+}
+
+void dpSymbolTable::enableCompactStorage(dpLoader *loader)
+{
+    m_record_loader = loader;
+}
+
+bool dpSymbolTable::isCompactStorageEnabled() const
+{
+    return m_record_loader!=nullptr;
+}
+
 void dpSymbolTable::addSymbol(dpSymbol *v)
 {
-    m_symbols.push_back(v);
+    uint32_t hash = dpHashName(v->name);
+    m_index.insert(hash, (uint32_t)m_names.size());
+    if(isCompactStorageEnabled()) { pushColumns(v->name, (size_t)v->address, v->flags, v->size, hash); }
+    else                          { pushColumns(v, hash); }
 }
 
+void dpSymbolTable::addSymbol(const char *name, void *addr, int flags, size_t size)
+{
+    uint32_t hash = dpHashName(name);
+    m_index.insert(hash, (uint32_t)m_names.size());
+    pushColumns(name, (size_t)addr, flags, size, hash);
+}
+
+void dpSymbolTable::addSymbols(dpSymbol *const *v, size_t n)
+{
+    size_t total = m_names.size()+n;
+    m_names.reserve(total);
+    m_hashes.reserve(total);
+    if(isCompactStorageEnabled()) {
+        m_addresses.reserve(total);
+        m_flags.reserve(total);
+        m_sizes.reserve(total);
+        for(size_t i=0; i<n; ++i) {
+            pushColumns(v[i]->name, (size_t)v[i]->address, v[i]->flags, v[i]->size, dpHashName(v[i]->name));
+        }
+    }
+    else {
+        m_symbols.reserve(total);
+        for(size_t i=0; i<n; ++i) {
+            pushColumns(v[i], dpHashName(v[i]->name));
+        }
+    }
+    mergePending();
+}
+
+// v と compact storage の設定が同じである必要がある
 void dpSymbolTable::merge(const dpSymbolTable &v)
 {
-    dpEach(v.m_symbols, [&](const dpSymbol *sym){
-        m_symbols.push_back( const_cast<dpSymbol*>(sym) );
-    });
-    sort();
+    appendColumns(v);
+    mergePending();
+}
+
+// tables と compact storage の設定が同じである必要がある。
+// 各 table をソート済みにしてから、先頭の名前が最小の table を heap で選びながら各列を直接並べていく。
+// merge(const dpSymbolTable&) を繰り返すと毎回全体を並べ替えることになるが、こちらは全体で 1 回で済む
+void dpSymbolTable::merge(dpSymbolTable *const *tables, size_t n)
+{
+    mergePending();
+    struct Cursor
+    {
+        const dpSymbolTable *table;
+        size_t pos;
+    };
+    std::vector<Cursor> cursors;
+    cursors.reserve(n+1);
+    size_t total = 0;
+    auto add_cursor = [&](dpSymbolTable *t){
+        t->mergePending();
+        if(t->getNumSymbols()==0) { return; }
+        Cursor c = {t, 0};
+        cursors.push_back(c);
+        total += t->getNumSymbols();
+    };
+    add_cursor(this);
+    for(size_t i=0; i<n; ++i) { add_cursor(tables[i]); }
+    if(cursors.size()<=1 && getNumSymbols()==total) { return; }
+
+    // heap の先頭が名前の最も小さいもの。名前が同じ場合は cursors の先にあるものを先に出す
+    auto greater = [&](uint32_t a, uint32_t b){
+        const Cursor &ca = cursors[a], &cb = cursors[b];
+        int c = strcmp(ca.table->m_names[ca.pos], cb.table->m_names[cb.pos]);
+        return c!=0 ? c>0 : a>b;
+    };
+    std::vector<uint32_t> heap;
+    heap.reserve(cursors.size());
+    for(uint32_t i=0; i<(uint32_t)cursors.size(); ++i) { heap.push_back(i); }
+    std::make_heap(heap.begin(), heap.end(), greater);
+
+    // 結果は別の table に並べてから列ごと入れ替える
+    dpSymbolTable merged;
+    merged.m_record_loader = m_record_loader;
+    merged.m_names.reserve(total);
+    merged.m_hashes.reserve(total);
+    if(isCompactStorageEnabled()) {
+        merged.m_addresses.reserve(total);
+        merged.m_flags.reserve(total);
+        merged.m_sizes.reserve(total);
+    }
+    else {
+        merged.m_symbols.reserve(total);
+    }
+    while(!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        uint32_t ci = heap.back();
+        Cursor &c = cursors[ci];
+        const dpSymbolTable &t = *c.table;
+        size_t i = c.pos;
+        if(merged.m_names.empty() || strcmp(merged.m_names.back(), t.m_names[i])!=0) {
+            merged.pushColumns(t, i);
+        }
+        if(++c.pos < t.getNumSymbols()) {
+            std::push_heap(heap.begin(), heap.end(), greater);
+        }
+        else {
+            heap.pop_back();
+        }
+    }
+    m_names.swap(merged.m_names);
+    m_hashes.swap(merged.m_hashes);
+    m_symbols.swap(merged.m_symbols);
+    m_addresses.swap(merged.m_addresses);
+    m_flags.swap(merged.m_flags);
+    m_sizes.swap(merged.m_sizes);
+    merged.m_record_loader = nullptr;
+    m_num_sorted = m_names.size();
+    buildIndex();
+}
+
+void dpSymbolTable::mergePending(bool force)
+{
+    size_t n = m_names.size();
+    size_t num_pending = n - m_num_sorted;
+    if(num_pending==0) { return; }
+    // 線形探索になる pending が大きくならないよう、ソート済み領域の大きさに関わらず一定数でマージする
+    if(!force && num_pending < max_pending) { return; }
+
+    // pending だけソートし、ソート済み領域と線形にマージして並び順を求める。
+    // 各列はその順に並べ替えるだけなので、ハッシュ値などを計算し直す必要はない
+    const name_cont &names = m_names;
+    auto less = [&](uint32_t a, uint32_t b){ return strcmp(names[a], names[b])<0; };
+    std::vector<uint32_t> pending(num_pending);
+    for(size_t i=0; i<num_pending; ++i) { pending[i] = (uint32_t)(m_num_sorted+i); }
+    std::stable_sort(pending.begin(), pending.end(), less);
+
+    std::vector<uint32_t> order;
+    order.reserve(n);
+    auto push = [&](uint32_t i){
+        // 同名の symbol は先にあったものを残す
+        if(order.empty() || strcmp(names[order.back()], names[i])!=0) {
+            order.push_back(i);
+        }
+    };
+    size_t si=0, pi=0;
+    while(si<m_num_sorted || pi<num_pending) {
+        if(pi==num_pending || (si<m_num_sorted && !less(pending[pi], (uint32_t)si))) {
+            push((uint32_t)si); ++si;
+        }
+        else {
+            push(pending[pi]); ++pi;
+        }
+    }
+    dpPermute(m_names, order);
+    dpPermute(m_hashes, order);
+    dpPermute(m_symbols, order);
+    dpPermute(m_addresses, order);
+    dpPermute(m_flags, order);
+    dpPermute(m_sizes, order);
+    m_num_sorted = m_names.size();
+    buildIndex();
 }
 
 void dpSymbolTable::sort()
 {
-    std::sort(m_symbols.begin(), m_symbols.end(), dpLTPtr<dpSymbol>());
-    m_symbols.erase(
-        std::unique(m_symbols.begin(), m_symbols.end(), dpEQPtr<dpSymbol>()),
-        m_symbols.end());
+    m_num_sorted = 0;
+    mergePending();
 }
 
 void dpSymbolTable::clear()
 {
+    m_names.clear();
+    m_hashes.clear();
     m_symbols.clear();
+    m_addresses.clear();
+    m_flags.clear();
+    m_sizes.clear();
+    m_index.clear();
+    m_ranges.clear();
+    m_num_sorted = 0;
+    m_ranges_dirty = false;
+    dpEach(m_records, [&](dpSymbol *sym){ m_record_loader->deleteSymbol(sym); });
+    m_records.clear();
+    m_record_index.clear();
 }
 
 void dpSymbolTable::enablePartialLink(bool v)
@@ -538,38 +1167,528 @@ void dpSymbolTable::enablePartialLink(bool v)
     m_partial_link = v;
 }
 
+bool dpSymbolTable::isPartialLinkEnabled() const
+{
+    return m_partial_link;
+}
+
 size_t dpSymbolTable::getNumSymbols() const
 {
-    return m_symbols.size();
+    return m_names.size();
 }
 
 dpSymbol* dpSymbolTable::getSymbol(size_t i)
 {
-    dpSymbol *sym = m_symbols[i];
-    return sym;
+    return getRecord(i);
+}
+
+const char* dpSymbolTable::getSymbolName(size_t i) const
+{
+    return m_names[i];
+}
+
+void* dpSymbolTable::getSymbolAddress(size_t i) const
+{
+    return (void*)addressAt(i);
+}
+
+int dpSymbolTable::getSymbolFlags(size_t i) const
+{
+    return isCompactStorageEnabled() ? m_flags[i] : m_symbols[i]->flags;
+}
+
+uint32_t dpSymbolTable::getSymbolHash(size_t i) const
+{
+    return m_hashes[i];
 }
 
 dpSymbol* dpSymbolTable::findSymbolByName(const char *name)
 {
-    auto p = std::lower_bound(m_symbols.begin(), m_symbols.end(), name,
-        [](const dpSymbol *sym, const char *name){ return *sym<name; }
-    );
-    if(p!=m_symbols.end() && **p==name) {
-        dpSymbol *sym = *p;
-        if(m_partial_link) { sym->partialLink(); }
-        return sym;
+    return onFound(peekSymbolByName(name));
+}
+
+dpSymbol* dpSymbolTable::findSymbolByAddress( void *addr )
+{
+    return onFound(peekSymbolByAddress(addr));
+}
+
+// 検索のためにマージはしない。ソート済み領域は範囲の index から、pending は線形に addr 以下で最も近い symbol を探す。
+// 範囲は size が分かっていればそれ、不明なら次の symbol の開始位置まで (次が無ければ開始位置のみ)
+dpSymbol* dpSymbolTable::findSymbolContainingAddress(void *addr)
+{
+    const size_t npos = ~size_t(0);
+    size_t a = (size_t)addr;
+    size_t start = 0, index = npos;
+    auto p = findRange(a);
+    if(p!=m_ranges.end()) {
+        start = addressAt(*p);
+        index = *p;
+    }
+    bool has_next = !m_ranges.empty() && addressAt(m_ranges.back())>a;
+    for(size_t i=m_num_sorted; i<m_names.size(); ++i) {
+        size_t ai = addressAt(i);
+        if(ai>a) { has_next = true; }
+        else if(index==npos || ai>start) { start=ai; index=i; }
+    }
+    if(index==npos) { return nullptr; }
+
+    size_t d = a - start;
+    size_t size = sizeAt(index);
+    if(d==0 || (size!=0 ? d<size : has_next)) {
+        return onFound(getRecord(index));
     }
     return nullptr;
 }
 
-dpSymbol* dpSymbolTable::findSymbolByAddress( void *addr )
+dpSymbol* dpSymbolTable::peekSymbolByName(const char *name)
+{
+    return peekSymbolByName(name, dpHashName(name));
+}
+
+dpSymbol* dpSymbolTable::peekSymbolByName(const char *name, uint32_t hash)
+{
+    uint32_t i = m_index.find(hash, [&](uint32_t si){ return strcmp(m_names[si], name)==0; });
+    return i!=dpNameIndex::npos ? getRecord(i) : nullptr;
+}
+
+dpSymbol* dpSymbolTable::peekSymbolByAddress(void *addr)
 {
-    auto p = dpFind(m_symbols, [=](const dpSymbol *sym){ return sym->address==addr; });
-    if(p!=m_symbols.end()) {
-        dpSymbol *sym = *p;
-        if(m_partial_link) { sym->partialLink(); }
-        return sym;
+    auto p = findRange((size_t)addr);
+    if(p!=m_ranges.end() && addressAt(*p)==(size_t)addr) {
+        return getRecord(*p);
+    }
+    for(size_t i=m_num_sorted; i<m_names.size(); ++i) {
+        if(addressAt(i)==(size_t)addr) { return getRecord(i); }
     }
     return nullptr;
 }
 
+// ソート済み領域のうち、名前が prefix で始まる範囲を求める
+void dpSymbolTable::getPrefixRange(const char *prefix, size_t len, size_t &begin, size_t &end) const
+{
+    auto first = m_names.begin();
+    auto last = m_names.begin()+m_num_sorted;
+    auto lb = std::lower_bound(first, last, prefix,
+        [&](const char *name, const char *pre){ return strncmp(name, pre, len)<0; });
+    auto ub = std::upper_bound(lb, last, prefix,
+        [&](const char *pre, const char *name){ return strncmp(pre, name, len)<0; });
+    begin = std::distance(first, lb);
+    end = std::distance(first, ub);
+}
+
+size_t dpSymbolTable::addressAt(size_t i) const
+{
+    return isCompactStorageEnabled() ? m_addresses[i] : (size_t)m_symbols[i]->address;
+}
+
+size_t dpSymbolTable::sizeAt(size_t i) const
+{
+    return isCompactStorageEnabled() ? m_sizes[i] : m_symbols[i]->size;
+}
+
+void dpSymbolTable::pushColumns(dpSymbol *sym, uint32_t hash)
+{
+    m_names.push_back(sym->name);
+    m_hashes.push_back(hash);
+    m_symbols.push_back(sym);
+}
+
+void dpSymbolTable::pushColumns(const char *name, size_t addr, int flags, size_t size, uint32_t hash)
+{
+    m_names.push_back(name);
+    m_hashes.push_back(hash);
+    m_addresses.push_back(addr);
+    m_flags.push_back(flags);
+    m_sizes.push_back((uint32_t)size);
+}
+
+void dpSymbolTable::pushColumns(const dpSymbolTable &v, size_t i)
+{
+    if(isCompactStorageEnabled()) { pushColumns(v.m_names[i], v.m_addresses[i], v.m_flags[i], v.m_sizes[i], v.m_hashes[i]); }
+    else                          { pushColumns(v.m_symbols[i], v.m_hashes[i]); }
+}
+
+void dpSymbolTable::appendColumns(const dpSymbolTable &v)
+{
+    m_names.insert(m_names.end(), v.m_names.begin(), v.m_names.end());
+    m_hashes.insert(m_hashes.end(), v.m_hashes.begin(), v.m_hashes.end());
+    m_symbols.insert(m_symbols.end(), v.m_symbols.begin(), v.m_symbols.end());
+    m_addresses.insert(m_addresses.end(), v.m_addresses.begin(), v.m_addresses.end());
+    m_flags.insert(m_flags.end(), v.m_flags.begin(), v.m_flags.end());
+    m_sizes.insert(m_sizes.end(), v.m_sizes.begin(), v.m_sizes.end());
+}
+
+// compact storage の場合、列の値から読み取り専用の dpSymbol を loader の allocator で作る。一度作ったものは名前で引いて使い回す
+dpSymbol* dpSymbolTable::getRecord(size_t i)
+{
+    if(!isCompactStorageEnabled()) { return m_symbols[i]; }
+
+    const char *name = m_names[i];
+    uint32_t hash = m_hashes[i];
+    uint32_t ri = m_record_index.find(hash, [&](uint32_t si){ return strcmp(m_records[si]->name, name)==0; });
+    if(ri!=dpNameIndex::npos) { return m_records[ri]; }
+
+    dpSymbol *sym = m_record_loader->newSymbol(name, (void*)m_addresses[i], m_flags[i], 0, nullptr, m_sizes[i]);
+    m_record_index.insert(hash, (uint32_t)m_records.size());
+    m_records.push_back(sym);
+    return sym;
+}
+
+dpSymbol* dpSymbolTable::onFound(dpSymbol *sym)
+{
+    if(sym && m_partial_link) { sym->partialLink(); }
+    return sym;
+}
+
+// addr 以下で最大の開始位置を持つ symbol の m_ranges 上の位置を返す。同じ開始位置の symbol が複数ある場合は名前順で最初のもの
+dpSymbolTable::range_cont::iterator dpSymbolTable::findRange(size_t addr)
+{
+    if(m_ranges_dirty) { buildAddressIndex(); }
+    auto p = std::upper_bound(m_ranges.begin(), m_ranges.end(), addr,
+        [&](size_t addr, uint32_t ri){ return addr<addressAt(ri); });
+    if(p==m_ranges.begin()) { return m_ranges.end(); }
+    --p;
+    size_t start = addressAt(*p);
+    return std::lower_bound(m_ranges.begin(), p, start,
+        [&](uint32_t ri, size_t addr){ return addressAt(ri)<addr; });
+}
+
+void dpSymbolTable::buildIndex()
+{
+    size_t n = m_hashes.size();
+    m_index.clear();
+    m_index.reserve(n);
+    for(size_t i=0; i<n; ++i) {
+        m_index.insert(m_hashes[i], (uint32_t)i);
+    }
+    m_ranges_dirty = true;
+}
+
+// ソート済み領域の index をアドレス順に並べる。アドレスは並べ替えの間だけ横に持つ
+void dpSymbolTable::buildAddressIndex()
+{
+    typedef std::pair<size_t, uint32_t> address_index;
+    size_t n = m_num_sorted;
+    std::vector<address_index> tmp(n);
+    for(size_t i=0; i<n; ++i) {
+        tmp[i] = address_index(addressAt(i), (uint32_t)i);
+    }
+    // 同じアドレスの symbol は名前順 (= index 順) に並ぶ
+    std::sort(tmp.begin(), tmp.end());
+    m_ranges.resize(n);
+    for(size_t i=0; i<n; ++i) { m_ranges[i] = tmp[i].second; }
+    m_ranges_dirty = false;
+}
+
+
+// 先頭のリテラル部分を取り出す。全体に選択 (|) が含まれる場合はリテラルが必須とは限らないので取り出さない
+static void dpExtractLeadingLiteral(const char *pattern, std::string &literal, bool &anchored)
+{
+    literal.clear();
+    anchored = false;
+    if(strchr(pattern, '|')) { return; }
+
+    static const char meta[] = "\\^$.|?*+()[]{}";
+    const char *c = pattern;
+    if(*c=='^') { anchored=true; ++c; }
+    while(*c!='\0') {
+        char ch;
+        const char *next;
+        if(*c=='\\') {
+            // \: や \. のような記号のエスケープのみリテラルとして扱う。\d などはここで打ち切り
+            if(c[1]=='\0' || isalnum((uint8_t)c[1])) { break; }
+            ch = c[1];
+            next = c+2;
+        }
+        else if(strchr(meta, *c)) {
+            break;
+        }
+        else {
+            ch = *c;
+            next = c+1;
+        }
+        // 直後に量指定子がある場合、この文字は現れないことがある
+        if(*next=='?' || *next=='*' || *next=='{') { break; }
+        literal += ch;
+        c = next;
+    }
+}
+
+dpSymbolFilter::dpSymbolFilter(const char *pattern)
+    : m_regex(pattern, std::regex::ECMAScript|std::regex::optimize)
+    , m_anchored(false)
+{
+    dpExtractLeadingLiteral(pattern, m_literal, m_anchored);
+}
+
+bool dpSymbolFilter::match(const char *name) const
+{
+    if(!m_literal.empty()) {
+        if(m_anchored) {
+            if(strncmp(name, m_literal.c_str(), m_literal.size())!=0) { return false; }
+        }
+        else {
+            if(strstr(name, m_literal.c_str())==nullptr) { return false; }
+        }
+    }
+    return std::regex_search(name, m_regex);
+}
+
+
+dpMergedSymbolIndex::dpMergedSymbolIndex()
+{
+}
+
+void dpMergedSymbolIndex::addTable(dpSymbolTable *table)
+{
+    m_tables.push_back(table);
+
+    size_t n = table->getNumSymbols();
+    m_names.index.reserve(m_names.index.size()+n);
+    address_cont added;
+    added.reserve(n);
+    for(size_t i=0; i<n; ++i) {
+        dpSymbol *sym = table->getSymbol(i);
+        uint32_t hash = table->getSymbolHash(i);
+        if(m_names.find(sym->name, hash)==dpNameIndex::npos) {
+            m_names.insert(sym, table, hash);
+        }
+        else {
+            m_shadowed.insert(sym, table, hash);
+        }
+        AddressEntry ae = {(size_t)sym->address, sym, table};
+        added.push_back(ae);
+    }
+    mergeAddresses(added);
+}
+
+void dpMergedSymbolIndex::removeTable(dpSymbolTable *table)
+{
+    auto it = std::find(m_tables.begin(), m_tables.end(), table);
+    if(it==m_tables.end()) { return; }
+    m_tables.erase(it);
+
+    // 後継を選ぶ際に table の位置を何度も引くので、先に表にしておく
+    typedef std::pair<const dpSymbolTable*, size_t> table_position;
+    std::vector<table_position> positions(m_tables.size());
+    for(size_t i=0; i<m_tables.size(); ++i) { positions[i] = table_position(m_tables[i], i); }
+    std::sort(positions.begin(), positions.end());
+    auto position_of = [&](const dpSymbolTable *t) -> size_t {
+        auto p = std::lower_bound(positions.begin(), positions.end(), table_position(t, 0));
+        return p!=positions.end() && p->first==t ? p->second : m_tables.size();
+    };
+
+    size_t n = table->getNumSymbols();
+    for(size_t i=0; i<n; ++i) {
+        dpSymbol *sym = table->getSymbol(i);
+        uint32_t hash = table->getSymbolHash(i);
+        uint32_t ei = m_names.find(sym, hash);
+        if(ei==dpNameIndex::npos) {
+            ei = m_shadowed.find(sym, hash);
+            if(ei!=dpNameIndex::npos) { m_shadowed.erase(hash, ei); }
+            continue;
+        }
+        m_names.erase(hash, ei);
+
+        // 隠れていた同名 symbol のうち、最も前にある table のものを後継にする
+        uint32_t best = dpNameIndex::npos;
+        size_t best_pos = m_tables.size();
+        m_shadowed.index.eachCandidates(hash, [&](uint32_t si){
+            const Entry &e = m_shadowed.entries[si];
+            if(*e.sym==sym->name) {
+                size_t pos = position_of(e.owner);
+                if(pos<best_pos) { best=si; best_pos=pos; }
+            }
+        });
+        if(best!=dpNameIndex::npos) {
+            Entry e = m_shadowed.entries[best];
+            m_shadowed.erase(hash, best);
+            m_names.insert(e.sym, e.owner, hash);
+        }
+    }
+
+    // アドレスも同様。外れた側も隠れている側もアドレス順に並べ、1 度の走査で後継を選ぶ
+    auto not_owned = [&](const AddressEntry &ae){ return ae.owner!=table; };
+    auto less = [](const AddressEntry &a, const AddressEntry &b){ return a.address<b.address; };
+    m_shadowed_addresses.erase(
+        std::stable_partition(m_shadowed_addresses.begin(), m_shadowed_addresses.end(), not_owned),
+        m_shadowed_addresses.end());
+    auto removed = std::stable_partition(m_addresses.begin(), m_addresses.end(), not_owned);
+    address_cont added;
+    if(!m_shadowed_addresses.empty() && removed!=m_addresses.end()) {
+        address_cont &shadowed = m_shadowed_addresses;
+        size_t num_shadowed = shadowed.size();
+        std::stable_sort(shadowed.begin(), shadowed.end(), less);
+        std::vector<char> promoted(num_shadowed, 0);
+        size_t si = 0;
+        for(auto p=removed; p!=m_addresses.end(); ++p) {
+            while(si<num_shadowed && shadowed[si].address<p->address) { ++si; }
+            size_t best = num_shadowed, best_pos = m_tables.size();
+            for(size_t i=si; i<num_shadowed && shadowed[i].address==p->address; ++i) {
+                size_t pos = position_of(shadowed[i].owner);
+                if(pos<best_pos) { best=i; best_pos=pos; }
+            }
+            if(best!=num_shadowed) {
+                added.push_back(shadowed[best]);
+                promoted[best] = 1;
+            }
+        }
+        size_t num_kept = 0;
+        for(size_t i=0; i<num_shadowed; ++i) {
+            if(!promoted[i]) { shadowed[num_kept++] = shadowed[i]; }
+        }
+        shadowed.resize(num_kept);
+    }
+    m_addresses.erase(removed, m_addresses.end());
+    mergeAddresses(added);
+}
+
+void dpMergedSymbolIndex::addSymbol(dpSymbol *sym, dpSymbolTable *owner)
+{
+    size_t pos = getTablePosition(owner);
+    if(pos==m_tables.size()) { return; }
+    uint32_t hash = dpHashName(sym->name);
+    if(m_names.find(sym, hash)!=dpNameIndex::npos || m_shadowed.find(sym, hash)!=dpNameIndex::npos) { return; }
+
+    // 同名の symbol が後の table のものであれば、そちらを隠れる側に回す
+    uint32_t ei = m_names.find(sym->name, hash);
+    if(ei==dpNameIndex::npos) {
+        m_names.insert(sym, owner, hash);
+    }
+    else if(getTablePosition(m_names.entries[ei].owner) > pos) {
+        Entry e = m_names.entries[ei];
+        m_names.erase(hash, ei);
+        m_shadowed.insert(e.sym, e.owner, hash);
+        m_names.insert(sym, owner, hash);
+    }
+    else {
+        m_shadowed.insert(sym, owner, hash);
+    }
+
+    // アドレスも同様
+    AddressEntry ae = {(size_t)sym->address, sym, owner};
+    auto p = findAddress(ae.address);
+    if(p!=m_addresses.end() && p->address==ae.address) {
+        if(getTablePosition(p->owner) > pos) { std::swap(*p, ae); }
+        m_shadowed_addresses.push_back(ae);
+    }
+    else {
+        address_cont added(1, ae);
+        mergeAddresses(added);
+    }
+}
+
+void dpMergedSymbolIndex::clear()
+{
+    m_tables.clear();
+    m_names = Names();
+    m_shadowed = Names();
+    m_addresses.clear();
+    m_shadowed_addresses.clear();
+}
+
+dpSymbol* dpMergedSymbolIndex::findSymbolByName(const char *name)
+{
+    uint32_t ei = m_names.find(name, dpHashName(name));
+    if(ei==dpNameIndex::npos) { return nullptr; }
+    const Entry &e = m_names.entries[ei];
+    return onFound(e.sym, e.owner);
+}
+
+dpSymbol* dpMergedSymbolIndex::peekSymbolByName(const char *name)
+{
+    uint32_t ei = m_names.find(name, dpHashName(name));
+    return ei!=dpNameIndex::npos ? m_names.entries[ei].sym : nullptr;
+}
+
+dpSymbol* dpMergedSymbolIndex::findSymbolByAddress(void *addr)
+{
+    auto p = findAddress((size_t)addr);
+    if(p==m_addresses.end() || p->address!=(size_t)addr) { return nullptr; }
+    return onFound(p->sym, p->owner);
+}
+
+dpSymbol* dpMergedSymbolIndex::findSymbolContainingAddress(void *addr)
+{
+    // 範囲の判定は候補の symbol を持つ table に任せる
+    auto p = findAddress((size_t)addr);
+    if(p==m_addresses.end()) { return nullptr; }
+    return p->owner->findSymbolContainingAddress(addr);
+}
+
+size_t dpMergedSymbolIndex::getTablePosition(const dpSymbolTable *table) const
+{
+    return std::distance(m_tables.begin(), std::find(m_tables.begin(), m_tables.end(), table));
+}
+
+// added を m_addresses にマージする。アドレスが重複する場合は先にあるものを残し、後のものは隠れている側に回す
+void dpMergedSymbolIndex::mergeAddresses(address_cont &added)
+{
+    auto less = [](const AddressEntry &a, const AddressEntry &b){ return a.address<b.address; };
+    std::stable_sort(added.begin(), added.end(), less);
+    address_cont unique;
+    unique.reserve(added.size());
+    for(size_t i=0; i<added.size(); ++i) {
+        const AddressEntry &ae = added[i];
+        if((!unique.empty() && unique.back().address==ae.address) ||
+            std::binary_search(m_addresses.begin(), m_addresses.end(), ae, less))
+        {
+            m_shadowed_addresses.push_back(ae);
+        }
+        else {
+            unique.push_back(ae);
+        }
+    }
+
+    size_t mid = m_addresses.size();
+    m_addresses.insert(m_addresses.end(), unique.begin(), unique.end());
+    std::inplace_merge(m_addresses.begin(), m_addresses.begin()+mid, m_addresses.end(), less);
+}
+
+// addr 以下で最大のアドレスを持つ要素
+dpMergedSymbolIndex::address_cont::iterator dpMergedSymbolIndex::findAddress(size_t addr)
+{
+    auto p = std::upper_bound(m_addresses.begin(), m_addresses.end(), addr,
+        [](size_t addr, const AddressEntry &ae){ return addr<ae.address; });
+    return p==m_addresses.begin() ? m_addresses.end() : --p;
+}
+
+dpSymbol* dpMergedSymbolIndex::onFound(dpSymbol *sym, dpSymbolTable *owner)
+{
+    if(owner->isPartialLinkEnabled()) { sym->partialLink(); }
+    return sym;
+}
+
+
+void dpMergedSymbolIndex::Names::insert(dpSymbol *sym, dpSymbolTable *owner, uint32_t hash)
+{
+    Entry e = {sym, owner};
+    uint32_t ei;
+    if(!vacant.empty()) {
+        ei = vacant.back();
+        vacant.pop_back();
+        entries[ei] = e;
+    }
+    else {
+        ei = (uint32_t)entries.size();
+        entries.push_back(e);
+    }
+    index.insert(hash, ei);
+}
+
+void dpMergedSymbolIndex::Names::erase(uint32_t hash, uint32_t ei)
+{
+    index.erase(hash, ei);
+    entries[ei].sym = nullptr;
+    vacant.push_back(ei);
+}
+
+uint32_t dpMergedSymbolIndex::Names::find(const char *name, uint32_t hash) const
+{
+    return index.find(hash, [&](uint32_t ei){ return *entries[ei].sym==name; });
+}
+
+uint32_t dpMergedSymbolIndex::Names::find(const dpSymbol *sym, uint32_t hash) const
+{
+    return index.find(hash, [&](uint32_t ei){ return entries[ei].sym==sym; });
+}
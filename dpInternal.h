@@ -37,9 +37,13 @@ enum dpLinkFlags {
     dpE_NeedsLink=1,
     dpE_NeedsBase=2,
 };
+enum dpResolveState {
+    dpE_Unresolved,
+    dpE_Resolved,
+    dpE_ResolveFailed,
+};
 enum dpSymbolFlagsEx {
     dpE_HostSymbol      = 0x10000,
-    dpE_NameNeedsDelete = 0x20000,
     dpE_LinkFailed      = 0x40000,
 };
 #define dpIsLinkFailed(flag) ((flag&dpE_LinkFailed)!=0)
@@ -51,8 +55,9 @@ struct dpSymbol
     int flags;
     int section;
     dpBinary *binary;
+    size_t size; // 0 の場合不明
 
-    dpSymbol(const char *nam, void *addr, int fla, int sect, dpBinary *bin);
+    dpSymbol(const char *nam, void *addr, int fla, int sect, dpBinary *bin, size_t siz=0);
     ~dpSymbol();
     const dpSymbolS& simplify() const;
     bool partialLink();
@@ -116,6 +121,8 @@ void    dpPrintDetail(const char* fmt, ...);
 void*   dpAllocateForward(size_t size, void *location);
 void*   dpAllocateBackward(size_t size, void *location);
 void*   dpAllocateModule(size_t size);
+// align: 2 の n 乗かつ 64kb 以上である必要がある
+void*   dpAllocateAligned(size_t size, size_t align);
 void    dpDeallocate(void *location, size_t size);
 dpTime  dpGetMTime(const char *path);
 dpTime  dpGetSystemTime();
@@ -123,6 +130,9 @@ bool    dpCopyFile(const char *srcpath, const char *dstpath);
 
 template<class F> void dpGlob(const char *path, const F &f);
 template<class F> bool dpMapFile(const char *path, void *&o_data, size_t &o_size, const F &alloc);
+// 読み取り専用で file を map する。dpUnmapFileView() で解放する必要がある
+bool    dpMapFileView(const char *path, const void *&o_data, size_t &o_size);
+void    dpUnmapFileView(const void *data);
 bool    dpWriteFile(const char *path, const void *data, size_t size);
 bool    dpDeleteFile(const char *path);
 bool    dpFileExists(const char *path);
@@ -131,6 +141,8 @@ size_t  dpSeparateFileExt(const char *filename, std::string *file, std::string *
 size_t  dpGetCurrentModulePath(char *buf, size_t buflen);
 size_t  dpGetMainModulePath(char *buf, size_t buflen);
 void    dpSanitizePath(std::string &path);
+// f(0)～f(n-1) を複数のスレッドで並列に実行し、全て終わるまで待つ。スレッド数は最大で論理コア数
+void    dpParallelFor(size_t n, const std::function<void (size_t)> &f);
 
 
 // アラインが必要な section データを再配置するための単純なアロケータ
@@ -184,23 +196,217 @@ public:
 private:
     class Page;
     typedef std::vector<Page*> page_cont;
-    page_cont m_pages;
+    page_cont m_pages; // 確保した全 page。アドレス順
+    // 空きのある page と満杯の page を別々のリストで持つ
+    Page *m_free_pages;
+    Page *m_full_pages;
+    size_t m_num_free_pages;
+
+    dpBlockAllocator(const dpBlockAllocator&);
+    dpBlockAllocator& operator=(const dpBlockAllocator&);
+    static void link(Page *&list, Page *p);
+    static void unlink(Page *&list, Page *p);
 };
 typedef dpBlockAllocator<1024*256, sizeof(dpSymbol)> dpSymbolAllocator;
 
+// obj のロード先のためのヒープ。host の module の近くに確保した chunk を size class 毎に切り分けて使う。
+// VirtualAlloc() は 64kb 単位なので、小さな obj (特に .lib の member) 毎に確保すると大半が無駄になる。
+// size class に収まらない大きさのものは直接 VirtualAlloc() する。全 context で共有するので lock を伴う
+class dpCodeHeap
+{
+public:
+    static const size_t chunk_size = 1024*64;
+    static const size_t min_block_size = 64;
+    static const size_t num_classes = 10; // 64byte ～ 32kb
+    struct ClassStats
+    {
+        size_t block_size;
+        size_t num_chunks;
+        size_t num_blocks; // 使用中の block 数
+    };
+    struct Stats
+    {
+        ClassStats classes[num_classes];
+        size_t num_large;     // size class に収まらず直接確保している数
+        size_t large_size;
+        size_t reserved_size; // OS から確保している総量
+    };
+
+    dpCodeHeap();
+    ~dpCodeHeap();
+    // 0 で埋められた領域を返す。align: 2 の n 乗である必要がある
+    void* allocate(size_t size, size_t align, void *location);
+    // 0 で埋められた領域を返すが、大きいものは OS から確保したばかりのページをそのまま返す。
+    // そのページは触るまで物理メモリが割り当てられない。.bss のような、書き込まれるまで使われない領域用
+    void* allocateDemandZero(size_t size, size_t align, void *location);
+    void  deallocate(void *p);
+    void  getStats(Stats &o) const;
+
+private:
+    struct FreeBlock { FreeBlock *next; };
+    struct SizeClass
+    {
+        FreeBlock *freelist;
+        char *bump; // 切り出し中の chunk のまだ使われていない領域
+        char *bump_end;
+        size_t num_chunks;
+        size_t num_blocks;
+    };
+    struct Chunk
+    {
+        uint32_t size_class;
+        uint32_t num_used;
+    };
+    typedef std::map<size_t, Chunk>  chunk_cont; // chunk の先頭アドレスから
+    typedef std::map<void*, size_t>  large_cont;
+
+    mutable dpMutex m_mutex;
+    SizeClass  m_classes[num_classes];
+    chunk_cont m_chunks;
+    large_cont m_large;
+
+    dpCodeHeap(const dpCodeHeap&);
+    dpCodeHeap& operator=(const dpCodeHeap&);
+    void releaseChunk(chunk_cont::iterator chunk);
+};
+dpCodeHeap& dpGetCodeHeap();
+
+uint32_t dpHashName(const char *name);
+uint32_t dpHashName(const char *name, size_t len);
+
+// 名前のハッシュ値から要素の index を引くためのハッシュテーブル (open addressing, 線形探査)
+// 要素本体は持たず、名前の比較は find() に渡す関数で行う
+class dpNameIndex
+{
+public:
+    static const uint32_t npos = 0xffffffff;
+
+    dpNameIndex();
+    void clear();
+    void reserve(size_t n);
+    void insert(uint32_t hash, uint32_t index);
+    bool erase(uint32_t hash, uint32_t index);
+    size_t size() const;
+
+    // F: [](uint32_t index) -> bool : index の要素が探している名前であれば true
+    template<class F>
+    uint32_t find(uint32_t hash, const F &eq) const
+    {
+        if(m_slots.empty()) { return npos; }
+        for(size_t i=hash&m_mask; ; i=(i+1)&m_mask) {
+            const Slot &s = m_slots[i];
+            if(s.index==npos) { return npos; }
+            if(s.hash==hash && eq(s.index)) { return s.index; }
+        }
+    }
+
+    // F: [](uint32_t index) : hash が一致する全要素に対して呼ばれる
+    template<class F>
+    void eachCandidates(uint32_t hash, const F &f) const
+    {
+        if(m_slots.empty()) { return; }
+        for(size_t i=hash&m_mask; ; i=(i+1)&m_mask) {
+            const Slot &s = m_slots[i];
+            if(s.index==npos) { return; }
+            if(s.hash==hash) { f(s.index); }
+        }
+    }
+
+private:
+    struct Slot
+    {
+        uint32_t hash;
+        uint32_t index;
+    };
+    typedef std::vector<Slot> slot_cont;
+    slot_cont m_slots;
+    size_t m_size;
+    size_t m_mask;
+
+    void rehash(size_t capacity);
+};
+
+// 追記のみの文字列プール。同じ文字列は同じ領域を共有し、解放は clear() でまとめて行う。
+// host symbol の名前のように、大量の小さな文字列を個別に new するのを避けるために使う
+class dpStringArena
+{
+public:
+    static const size_t default_chunk_size = 1024*64;
+    struct Stats
+    {
+        size_t num_strings;  // 格納されている文字列の数
+        size_t num_requests; // intern() が呼ばれた回数
+        size_t used_bytes;
+        size_t reserved_bytes;
+    };
+
+    // 格納する量が少ないと分かっている場合は chunk_size を小さくしておく
+    explicit dpStringArena(size_t chunk_size=default_chunk_size);
+    ~dpStringArena();
+    const char* intern(const char *str);
+    const char* intern(const char *str, size_t len);
+    void clear();
+    const Stats& getStats() const;
+
+private:
+    typedef std::vector<char*>       chunk_cont;
+    typedef std::vector<const char*> string_cont;
+    chunk_cont  m_chunks;
+    string_cont m_strings;
+    dpNameIndex m_index; // name -> m_strings
+    size_t m_chunk_size;
+    char  *m_cur;
+    size_t m_cur_left;
+    Stats  m_stats;
+
+    dpStringArena(const dpStringArena&);
+    dpStringArena& operator=(const dpStringArena&);
+    char* allocate(size_t size);
+};
+
+// ソート済みの領域と、その後ろに追加された未ソートの領域 (pending) の 2 段構成になっている。
+// 名前とハッシュは列に持ち、名前での検索はソート済み / pending のどちらもハッシュで引く。
+// 通常の table は加えて dpSymbol の列を持ち、アドレス / フラグ / サイズはロード後に書き換わりうるので dpSymbol 側を見る。
+// compact storage が有効な table は dpSymbol を持たず、アドレス / フラグ / サイズも列に持つ (host symbol 用)。
+// 検索で返す dpSymbol はその時に作る読み取り専用の写しで、値は列の方が正となる。
 class dpSymbolTable
 {
 public:
     dpSymbolTable();
+    ~dpSymbolTable();
+    // 空の状態で呼ぶ必要がある。検索で返す dpSymbol は loader の allocator で確保する
+    void enableCompactStorage(dpLoader *loader);
+    bool isCompactStorageEnabled() const;
+    // pending 領域に追加する。アドレスでの検索は mergePending() されるまで pending 分が線形探索になる (max_pending 個まで)
     void addSymbol(dpSymbol *v);
+    // compact storage 用。name は table より長く生存している必要がある
+    void addSymbol(const char *name, void *addr, int flags, size_t size=0);
+    // まとめて追加してソート済み領域にマージする
+    void addSymbols(dpSymbol *const *v, size_t n);
     void merge(const dpSymbolTable &v);
+    // 複数の table を一度の k-way merge でマージする。同名の symbol は既にあるもの、tables の先にあるものが優先される
+    void merge(dpSymbolTable *const *tables, size_t n);
+    // force==false の場合、pending が max_pending 個溜まった時だけマージする
+    void mergePending(bool force=true);
     void sort();
     void clear();
     void            enablePartialLink(bool v);
+    bool            isPartialLinkEnabled() const;
     size_t          getNumSymbols() const;
+    // compact storage の場合、この時点で dpSymbol が作られる
     dpSymbol*       getSymbol(size_t i);
+    const char*     getSymbolName(size_t i) const;
+    void*           getSymbolAddress(size_t i) const;
+    int             getSymbolFlags(size_t i) const;
+    uint32_t        getSymbolHash(size_t i) const;
     dpSymbol*       findSymbolByName(const char *name);
     dpSymbol*       findSymbolByAddress(void *sym);
+    // addr を含む symbol を探す。symbol の範囲は size と次の symbol の開始位置から求める
+    dpSymbol*       findSymbolContainingAddress(void *addr);
+    // peek* は partial link を行わない
+    dpSymbol*       peekSymbolByName(const char *name);
+    dpSymbol*       peekSymbolByName(const char *name, uint32_t hash);
+    dpSymbol*       peekSymbolByAddress(void *addr);
 
     // F: [](const dpSymbol *sym)
     template<class F>
@@ -210,10 +416,150 @@ public:
         for(size_t i=0; i<n; ++i) { f(getSymbol(i)); }
     }
 
+    // 名前が prefix で始まる symbol を列挙する。ソート済み領域は二分探索で範囲を絞る
+    // F: [](const dpSymbol *sym)
+    template<class F>
+    void eachSymbolsWithPrefix(const char *prefix, const F &f)
+    {
+        size_t len = strlen(prefix);
+        size_t begin, end;
+        getPrefixRange(prefix, len, begin, end);
+        for(size_t i=begin; i<end; ++i) { f(getSymbol(i)); }
+        size_t n = getNumSymbols();
+        for(size_t i=m_num_sorted; i<n; ++i) {
+            if(strncmp(m_names[i], prefix, len)==0) { f(getSymbol(i)); }
+        }
+    }
+
 private:
-    typedef std::vector<dpSymbol*> symbol_cont;
-    symbol_cont m_symbols;
+    static const size_t max_pending = 256;
+    typedef std::vector<dpSymbol*>   symbol_cont;
+    typedef std::vector<const char*> name_cont;
+    typedef std::vector<size_t>      address_cont;
+    typedef std::vector<int>         flag_cont;
+    typedef std::vector<uint32_t>    hash_cont;
+    typedef std::vector<uint32_t>    size_cont;
+    typedef std::vector<uint32_t>    range_cont;
+
+    name_cont    m_names;
+    hash_cont    m_hashes;
+    dpNameIndex  m_index;
+    // 通常の table のみ
+    symbol_cont  m_symbols;
+    // compact storage の場合のみ
+    address_cont m_addresses;
+    flag_cont    m_flags;
+    size_cont    m_sizes;   // 0 の場合不明
+    range_cont   m_ranges; // ソート済み領域のアドレス順の index。必要になった時点で構築する
+    size_t m_num_sorted;
+    bool m_ranges_dirty;
     bool m_partial_link;
+    // compact storage の dpSymbol の確保先。nullptr なら compact storage は無効
+    dpLoader    *m_record_loader;
+    // compact storage で作られた dpSymbol。名前で引く
+    symbol_cont  m_records;
+    dpNameIndex  m_record_index;
+
+    dpSymbolTable(const dpSymbolTable&);
+    dpSymbolTable& operator=(const dpSymbolTable&);
+    void pushColumns(dpSymbol *sym, uint32_t hash);
+    void pushColumns(const char *name, size_t addr, int flags, size_t size, uint32_t hash);
+    void pushColumns(const dpSymbolTable &v, size_t i);
+    void appendColumns(const dpSymbolTable &v);
+    void getPrefixRange(const char *prefix, size_t len, size_t &begin, size_t &end) const;
+    void buildIndex();
+    void buildAddressIndex();
+    size_t addressAt(size_t i) const;
+    size_t sizeAt(size_t i) const;
+    range_cont::iterator findRange(size_t addr);
+    dpSymbol* getRecord(size_t i);
+    dpSymbol* onFound(dpSymbol *sym);
+};
+
+// symbol 名に対する正規表現フィルタ (regex_search)。
+// 正規表現の先頭のリテラル部分を取り出しておき、^ で始まる場合は symbol table を名前の範囲で絞り、
+// そうでない場合は strstr() で先に弾いてから正規表現を評価する。
+class dpSymbolFilter
+{
+public:
+    dpSymbolFilter(const char *pattern);
+    bool match(const char *name) const;
+
+    // match() する可能性のある symbol を列挙する。最終的な判定は match() で行う必要がある
+    // F: [](const dpSymbol *sym)
+    template<class F>
+    void eachCandidates(dpSymbolTable &table, const F &f) const
+    {
+        if(m_anchored) { table.eachSymbolsWithPrefix(m_literal.c_str(), f); }
+        else           { table.eachSymbols(f); }
+    }
+
+private:
+    std::regex  m_regex;
+    std::string m_literal; // 名前に必ず含まれる文字列
+    bool        m_anchored; // m_literal が名前の先頭にある必要がある
+};
+
+// 複数の dpSymbolTable を束ねた検索用 index。dpLoader が全 binary の symbol を 1 回の探索で引くのに使う。
+// 同名 / 同アドレスの symbol が複数の table にある場合、先に追加された table のものが優先される。
+class dpMergedSymbolIndex
+{
+public:
+    dpMergedSymbolIndex();
+    // table は追加以降変更されない前提 (addSymbol() で知らせる場合を除く)
+    void addTable(dpSymbolTable *table);
+    void removeTable(dpSymbolTable *table);
+    // addTable() 済みの owner に後から加えた symbol を登録する。
+    // table の位置は変わらないので、同名の symbol とどちらが優先されるかは addTable() した順で決まる
+    void addSymbol(dpSymbol *sym, dpSymbolTable *owner);
+    void clear();
+    dpSymbol* findSymbolByName(const char *name);
+    dpSymbol* findSymbolByAddress(void *addr);
+    dpSymbol* findSymbolContainingAddress(void *addr);
+    // partial link を行わない
+    dpSymbol* peekSymbolByName(const char *name);
+
+private:
+    struct Entry
+    {
+        dpSymbol *sym; // nullptr の場合空き
+        dpSymbolTable *owner;
+    };
+    struct AddressEntry
+    {
+        size_t address;
+        dpSymbol *sym;
+        dpSymbolTable *owner;
+    };
+    typedef std::vector<dpSymbolTable*> table_cont;
+    typedef std::vector<Entry>          entry_cont;
+    typedef std::vector<AddressEntry>   address_cont;
+    typedef std::vector<uint32_t>       index_cont;
+
+    // 優先されている symbol と、同名の symbol が先にあるため隠れている symbol を別々に持つ。
+    // table が外されたときは隠れている側から後継を選ぶので、他の table を探し直す必要はない。
+    struct Names
+    {
+        entry_cont  entries;
+        index_cont  vacant;
+        dpNameIndex index; // name -> entries
+
+        void insert(dpSymbol *sym, dpSymbolTable *owner, uint32_t hash);
+        void erase(uint32_t hash, uint32_t ei);
+        uint32_t find(const char *name, uint32_t hash) const;
+        uint32_t find(const dpSymbol *sym, uint32_t hash) const;
+    };
+
+    table_cont   m_tables;
+    Names        m_names;
+    Names        m_shadowed;
+    address_cont m_addresses; // アドレス順
+    address_cont m_shadowed_addresses;
+
+    size_t getTablePosition(const dpSymbolTable *table) const;
+    void mergeAddresses(address_cont &added);
+    address_cont::iterator findAddress(size_t addr);
+    dpSymbol* onFound(dpSymbol *sym, dpSymbolTable *owner);
 };
 
 #define dpGetBuilder()  m_context->getBuilder()
@@ -252,6 +598,15 @@ public:
     virtual bool loadMemory(const char *name, void *data, size_t datasize, dpTime filetime)=0;
     virtual bool link()=0;
     virtual bool partialLink(size_t section)=0;
+    // dpLoader::link() が全 binary の未定義 symbol をまとめて解決するためのもの。
+    // eachUndefinedSymbols() で名前を集め、解決したものを resolveUndefinedSymbols() で渡す
+    virtual void eachUndefinedSymbols(const std::function<void (const char*)> &f)=0;
+    virtual void resolveUndefinedSymbols(const std::function<const dpSymbol* (const char*)> &resolver)=0;
+    // 他の binary の差し替えで解決結果が古くなった再配置を持つ section を要リンク状態に戻す。
+    // is_stale(owner, name): 前回 owner (host なら nullptr) の symbol に解決された name を解決し直すべきか
+    // is_resolvable(name): 前回解決できなかった name が今回は解決できうるか
+    // 戻り値は要リンクの section があるか
+    virtual bool invalidateLink(const std::function<bool (const dpBinary*, const char*)> &is_stale, const std::function<bool (const char*)> &is_resolvable)=0;
     virtual bool callHandler(dpEventType e)=0;
 
     virtual dpSymbolTable& getSymbolTable()=0;
@@ -275,8 +630,13 @@ public:
     void unload();
     virtual bool loadFile(const char *path);
     virtual bool loadMemory(const char *name, void *data, size_t datasize, dpTime filetime);
+    // view の中身を必要な部分だけコピーしてロードする。view は呼び出し後すぐに解放してよい
+    bool loadView(const char *name, const void *view, size_t viewsize, dpTime filetime);
     virtual bool link();
     virtual bool partialLink(size_t section);
+    virtual void eachUndefinedSymbols(const std::function<void (const char*)> &f);
+    virtual void resolveUndefinedSymbols(const std::function<const dpSymbol* (const char*)> &resolver);
+    virtual bool invalidateLink(const std::function<bool (const dpBinary*, const char*)> &is_stale, const std::function<bool (const char*)> &is_resolvable);
     virtual bool callHandler(dpEventType e);
 
     virtual dpSymbolTable& getSymbolTable();
@@ -284,32 +644,66 @@ public:
     virtual dpTime         getLastModifiedTime() const;
     virtual dpFileType     getFileType() const;
 
+    // 並列リンク用。要リンクの section の再配置先の symbol を全て解決しておく。
+    // この後は別々の section に対する partialLink() を複数のスレッドから同時に呼んでよい
+    void   prepareParallelLink();
+    size_t getNumSections() const;
+    // code section の内容のハッシュ。再配置先は名前で比較されるので、ロード先のアドレスに依存しない。code section 以外は 0
+    uint64_t getSectionHash(size_t section) const;
     void* getBaseAddress() const;
+    // 実行時に必要な section が占めるサイズ
+    size_t getResidentSize() const;
 
 private:
-    struct RelocationData
+    // ロードが終わるとファイルのイメージは解放されるので、リンクに必要な情報は全てここに写しておく
+    struct RelocationData // IMAGE_RELOCATION と対になるデータ
     {
-        uint32_t base;
-        RelocationData() : base(0) {}
+        uint32_t base;   // 再配置前の値
+        uint32_t offset; // section 内の位置
+        uint32_t target; // 参照先の m_resolvedata の index
+        uint16_t type;
+        RelocationData() : base(0), offset(0), target(0), type(0) {}
     };
     struct LinkData // section と対になるデータ
     {
         uint32_t flags;
-        LinkData() : flags(dpE_NeedsLink|dpE_NeedsBase) {}
+        uint32_t reloc_offset; // この section の再配置の m_relocdata 内での位置
+        uint32_t num_relocations; // ロード時に移されなかった section は 0
+        size_t base; // section の配置先
+        uint64_t hash; // getSectionHash()
+        LinkData() : flags(dpE_NeedsLink|dpE_NeedsBase), reloc_offset(0), num_relocations(0), base(0), hash(0) {}
+    };
+    struct ResolveData // 再配置から参照される symbol と対になるデータ
+    {
+        const char *name; // m_names のもの
+        size_t address;
+        const dpBinary *owner; // 解決先の symbol を持つ binary。host の場合 nullptr
+        uint32_t state; // dpResolveState
+        bool undefined; // この obj の中で定義されていない
+        ResolveData() : name(nullptr), address(0), owner(nullptr), state(dpE_Unresolved), undefined(false) {}
     };
     typedef std::vector<LinkData>       link_cont;
     typedef std::vector<RelocationData> reloc_cont;
-    void  *m_data;
-    size_t m_size;
+    typedef std::vector<ResolveData>    resolve_cont;
     void  *m_aligned_data;
     size_t m_aligned_datasize;
+    void  *m_bss_data; // 初期値を持たない section (.bss) はファイル上に中身が無いので、別の領域に置く
+    size_t m_bss_datasize;
     std::string m_path;
     dpTime m_mtime;
     dpSymbolTable m_symbols;
+    dpStringArena m_names; // symbol の名前
     link_cont m_linkdata;
     reloc_cont m_relocdata;
-
-    void* resolveSymbol(const char *name);
+    resolve_cont m_resolvedata; // 再配置で参照される symbol の解決結果。ロードの度に作り直し、全 section で共有する
+
+    // data: ファイルのイメージ。読むだけで書き換えない (読み取り専用の view でよい)
+    bool  loadImpl(const char *path, const void *data, size_t size, dpTime mtime);
+    const dpSymbol* resolveSymbol(const char *name);
+    // 再配置が参照する symbol の解決。結果は m_resolvedata に記録され、2 度目以降はそれを返す
+    size_t resolveRelocationTarget(uint32_t target);
+    // F: [](ResolveData &rd)
+    template<class F> void eachReferencedUndefinedSymbols(const F &f);
 };
 
 class dpLibFile : public dpBinary
@@ -323,6 +717,9 @@ public:
     virtual bool loadMemory(const char *name, void *data, size_t datasize, dpTime filetime);
     virtual bool link();
     virtual bool partialLink(size_t section);
+    virtual void eachUndefinedSymbols(const std::function<void (const char*)> &f);
+    virtual void resolveUndefinedSymbols(const std::function<const dpSymbol* (const char*)> &resolver);
+    virtual bool invalidateLink(const std::function<bool (const dpBinary*, const char*)> &is_stale, const std::function<bool (const char*)> &is_resolvable);
     virtual bool callHandler(dpEventType e);
 
     virtual dpSymbolTable& getSymbolTable();
@@ -333,15 +730,58 @@ public:
     dpObjFile*             getObjFile(size_t index);
     dpObjFile*             findObjFile(const char *name);
 
+    // 遅延ロード (dpE_SysLazyLibMembers) でロードされ、まだロードされていない member があるか
+    bool   hasLazyMembers() const;
+    // name を定義している未ロードの member があるか
+    bool   hasLazyMemberDefining(const char *name) const;
+    // names (ソート済み) のいずれかを定義している未ロードの member をロードし、loaded に加える。ロードした数を返す。
+    // ロードした member の symbol は mergeMemberSymbols() を呼ぶまで getSymbolTable() には反映されない
+    size_t loadMembersDefining(const std::vector<const char*> &names, std::vector<dpObjFile*> &loaded);
+    void   mergeMemberSymbols(const std::vector<dpObjFile*> &objs);
+    // 差し替え前の lib を指定しておくと、次の loadFile() で中身の変わらない member をそこから引き継ぐ (prev からは取り除かれる)
+    void   setPredecessor(dpLibFile *prev);
+
     template<class F>
     void eachObjs(const F &f) { dpEach(m_objs, f); }
 
 private:
     typedef std::vector<dpObjFile*> obj_cont;
+    struct MemberIndex // linker member から取った、symbol 名と定義している member の組
+    {
+        const char *name; // m_member_names のもの
+        uint32_t offset;  // member のヘッダの .lib 先頭からの位置
+    };
+    typedef std::vector<MemberIndex> member_cont;
+    struct MemberLoad // ロードする member。member の発見 (逐次) と解析 (並列) を分けるのに使う
+    {
+        std::string name;
+        const char *data;
+        uint32_t size;
+        uint32_t mtime;
+        uint64_t checksum;
+        dpObjFile *obj; // 解析または引き継ぎの結果
+    };
+    typedef std::vector<MemberLoad> member_load_cont;
     obj_cont m_objs;
+    std::vector<uint64_t> m_checksums; // m_objs と対になる、member の中身のハッシュ
+    dpNameIndex m_obj_index; // 正規化した member 名 -> m_objs
+    dpLibFile *m_predecessor;
     dpSymbolTable m_symbols;
     std::string m_path;
     dpTime m_mtime;
+    member_cont m_members; // 名前でソート済み
+    std::vector<uint32_t> m_loaded_members; // ロード済みの member の offset。ソート済み
+    size_t m_num_members; // m_members から参照されている member の数
+    dpStringArena m_member_names;
+    uint32_t m_longnames; // long name セクションの位置。無い場合 0
+
+    bool loadIndex(const char *path, const void *lib_data, size_t lib_size, dpTime mtime);
+    bool readMember(const char *lib_data, size_t lib_size, uint32_t offset, MemberLoad &o) const;
+    void parseMembers(member_load_cont &members, const std::vector<size_t> &indices);
+    void takeOverMembers(const char *lib_data, size_t lib_size);
+    uint32_t findObjIndex(const char *name) const;
+    void addObj(dpObjFile *obj, uint64_t checksum);
+    dpObjFile* releaseObj(uint32_t i);
 };
 
 // ロード中の dll は上書き不可能で、そのままだと実行時リビルドできない。
@@ -358,6 +798,9 @@ public:
     virtual bool loadMemory(const char *name, void *data, size_t datasize, dpTime filetime);
     virtual bool link();
     virtual bool partialLink(size_t section);
+    virtual void eachUndefinedSymbols(const std::function<void (const char*)> &f);
+    virtual void resolveUndefinedSymbols(const std::function<const dpSymbol* (const char*)> &resolver);
+    virtual bool invalidateLink(const std::function<bool (const dpBinary*, const char*)> &is_stale, const std::function<bool (const char*)> &is_resolvable);
     virtual bool callHandler(dpEventType e);
 
     virtual dpSymbolTable& getSymbolTable();
@@ -365,8 +808,15 @@ public:
     virtual dpTime         getLastModifiedTime() const;
     virtual dpFileType     getFileType() const;
 
+    // 以下は遅延 export (dpE_SysLazyDllExports) でロードされた場合のみ有効で、それ以外は nullptr を返す。
+    // findExport() は必要なら symbol を作って symbol table に加える。findExportAddress() は symbol を作らない
+    bool      hasLazyExports() const;
+    dpSymbol* findExport(const char *name);
+    void*     findExportAddress(const char *name) const;
+
 private:
     HMODULE m_module;
+    IMAGE_EXPORT_DIRECTORY *m_exports; // 遅延 export の場合のみ
     bool m_needs_freelibrary;
     std::string m_path;
     std::string m_actual_file;
@@ -396,6 +846,7 @@ public:
 
     dpSymbol* findSymbolByName(const char *name);
     dpSymbol* findSymbolByAddress(void *addr);
+    dpSymbol* findSymbolContainingAddress(void *addr);
     dpSymbol* findHostSymbolByName(const char *name);
     dpSymbol* findHostSymbolByAddress(void *addr);
 
@@ -408,7 +859,7 @@ public:
     }
 
     void addOnLoadList(dpBinary *bin);
-    dpSymbol* newSymbol(const char *nam=nullptr, void *addr=nullptr, int fla=0, int sect=0, dpBinary *bin=nullptr);
+    dpSymbol* newSymbol(const char *nam=nullptr, void *addr=nullptr, int fla=0, int sect=0, dpBinary *bin=nullptr, size_t siz=0);
     void deleteSymbol(dpSymbol *sym);
 
     void addForceHostSymbolPattern(const char *pattern);
@@ -416,21 +867,80 @@ public:
 
     bool   loadMapFile(const char *path, void *imagebase);
     size_t loadMapFiles();
+    const dpStringArena::Stats& getNameArenaStats() const;
 
 private:
+    static const size_t max_host_misses = 4096;
+    static const size_t max_force_host_verdicts = 4096;
     typedef std::vector<dpBinary*>  binary_cont;
-    typedef std::vector<std::regex> pattern_cont;
+    typedef std::vector<HMODULE>    module_cont;
+    typedef std::vector<std::string> pattern_cont;
     typedef std::set<std::string>   string_set;
+    typedef std::vector<const char*> name_cont;
+    struct ForceHostVerdict
+    {
+        const char *name; // m_force_host_verdict_names のもの
+        bool force;
+    };
+    typedef std::vector<ForceHostVerdict> verdict_cont;
 
     dpContext *m_context;
     string_set m_mapfiles_read;
-    pattern_cont m_force_host_symbol_patterns;
+    // 全 pattern を 1 つの正規表現にまとめたもので判定し、結果を名前ごとに覚えておく。
+    // 結果は pattern が変わると無効になり、max_force_host_verdicts 個溜まったら一旦全て忘れる
+    pattern_cont  m_force_host_symbol_patterns;
+    std::regex    m_force_host_matcher;
+    bool          m_force_host_matcher_dirty;
+    dpStringArena m_force_host_verdict_names;
+    verdict_cont  m_force_host_verdicts;
+    dpNameIndex   m_force_host_verdict_index;
     binary_cont m_binaries;
     binary_cont m_onload_queue;
+    // 前回のリンク以降にアンロードされた binary (lib の場合はその中の obj も)。これを参照していた binary は再リンクが必要
+    std::vector<const dpBinary*> m_unloaded;
+    // reload で差し替えられた binary と差し替え先の組。OnUnload は差し替えの時点で呼び済み。
+    // 中身の変わらない関数の patch を差し替え先に引き継げるよう、差し替え前の binary のメモリの解放は次のリンクまで遅らせる
+    std::vector<std::pair<dpBinary*, dpBinary*> > m_retired;
+    dpStringArena m_hostnames; // m_hostsymbols の名前
     dpSymbolTable m_hostsymbols;
+    // DbgHelp でも見つからなかった名前。process の module 構成が変わるか .map を読むと無効になる。
+    // 名前は専用の arena に置き、max_host_misses 個溜まったら一旦全て忘れる
+    dpStringArena m_hostmiss_names;
+    name_cont     m_hostmisses;
+    dpNameIndex   m_hostmiss_index;
+    // 前回調べた時点の module 一覧 (アドレス順)。link 中は最初に一度だけ調べる
+    module_cont   m_host_modules;
+    bool          m_host_modules_checked;
+    // 前回のリンク以降に host の symbol が増えうること (module 一覧の変化や .map の読み込み) があったか
+    bool          m_host_symbols_changed;
+    dpMergedSymbolIndex m_symbol_index; // m_binaries の全 symbol
+    // 遅延 export の dll (ロード順) と、それらを既に引いた名前。名前は遅延 export の dll がロードされる度に忘れる
+    binary_cont   m_lazy_dlls;
+    dpStringArena m_lazy_checked_names;
+    name_cont     m_lazy_checked;
+    dpNameIndex   m_lazy_checked_index;
+    dpMutex m_symalloc_mutex; // lib の member は並列に解析されるので、symbol の確保はロックする
     dpSymbolAllocator m_symalloc;
 
     void       unloadImpl(dpBinary *bin);
+    void       detachBinary(dpBinary *bin);
+    void       destroyBinary(dpBinary *bin);
+    void       releaseBinary(dpBinary *bin);
+    void       retireBinary(dpBinary *old, dpBinary *replacement);
+    void       releaseRetiredBinaries(bool retarget);
+    void       clearHostSymbolMisses();
+    void       clearForceHostVerdicts();
+    bool       updateHostModules();
+    void       clearLazyExportChecks();
+    void       checkLazyExports(const char *name);
+    dpSymbol*  peekSymbolByName(const char *name);
+    const dpSymbol* resolveExternalSymbol(const char *name);
+    void       resolveUndefinedSymbols(binary_cont &bins);
+    bool       isStaleReference(const dpBinary *owner, const char *name);
+    bool       isResolvableReference(const char *name);
+    bool       isDefinedByNewBinary(const dpBinary *owner, const char *name);
+    bool       linkParallel(binary_cont &bins);
+    size_t     loadLibMembers(binary_cont &targets);
     template<class BinaryType>
     BinaryType* loadBinaryImpl(const char *path);
 };
@@ -442,7 +952,10 @@ public:
     dpPatcher(dpContext *ctx);
     ~dpPatcher();
     void*  patchByBinary(dpBinary *obj, const std::function<bool (const dpSymbolS&)> &condition);
+    void*  patchByBinary(dpBinary *obj, const dpSymbolFilter &filter);
     void*  patch(dpSymbol *target, dpSymbol *hook);
+    // old の関数への patch のうち、replacement に中身の変わらない関数があるものを、patch し直さずにそちらへ向ける
+    size_t retargetPatches(dpBinary *old, dpBinary *replacement);
     size_t unpatchByBinary(dpBinary *obj);
     bool   unpatchByAddress(void *patched);
     void   unpatchAll();
@@ -459,6 +972,7 @@ private:
 
     void         patchImpl(dpPatchData &pi);
     void         unpatchImpl(const dpPatchData &pi);
+    bool         retargetImpl(dpPatchData &pi, const dpSymbol *hook);
     patch_cont::iterator findPatchByNameImpl(const char *name);
     patch_cont::iterator findPatchByAddressImpl(void *addr);
 };
@@ -541,11 +1055,17 @@ public:
     void   unpatchAll();
     void*  getUnpatched(void *target_or_hook_addr);
     void   addForceHostSymbolPattern(const char *pattern);
+    const dpSymbolS* findSymbolByAddress(void *addr);
 
 private:
+    typedef std::map<std::string, dpSymbolFilter> filter_cont;
+
     dpBuilder *m_builder;
     dpPatcher *m_patcher;
     dpLoader  *m_loader;
+    filter_cont m_filters; // patchByFile() に渡された正規表現のキャッシュ
+
+    const dpSymbolFilter& getSymbolFilter(const char *pattern);
 };
 
 
@@ -8,7 +8,17 @@
 #pragma comment(lib, "psapi.lib")
 
 
-static const int g_host_symbol_flags = dpE_Code|dpE_Read|dpE_Execute|dpE_HostSymbol|dpE_NameNeedsDelete;
+static const int g_host_symbol_flags = dpE_Code|dpE_Read|dpE_Execute|dpE_HostSymbol;
+
+static void dpGetProcessModules(std::vector<HMODULE> &modules)
+{
+    DWORD num_modules;
+    ::EnumProcessModules(::GetCurrentProcess(), nullptr, 0, &num_modules);
+    modules.resize(num_modules/sizeof(HMODULE));
+    if(modules.empty()) { return; }
+    ::EnumProcessModules(::GetCurrentProcess(), &modules[0], num_modules, &num_modules);
+    modules.resize(num_modules/sizeof(HMODULE));
+}
 
 
 dpSymbol* dpLoader::findHostSymbolByName(const char *name)
@@ -16,19 +26,28 @@ dpSymbol* dpLoader::findHostSymbolByName(const char *name)
     if(dpSymbol *sym = m_hostsymbols.findSymbolByName(name)) {
         return sym;
     }
+    // 一度 DbgHelp で見つからなかった名前は、状況が変わるまで問い合わせない。
+    // host 側で LoadLibrary() された module にあるかもしれないので、module 一覧が変わっていれば問い合わせ直す
+    uint32_t hash = dpHashName(name);
+    if(m_hostmiss_index.find(hash, [&](uint32_t i){ return strcmp(m_hostmisses[i], name)==0; })!=dpNameIndex::npos) {
+        if(m_host_modules_checked || !updateHostModules()) { return nullptr; }
+    }
 
     char buf[sizeof(SYMBOL_INFO)+1024];
     PSYMBOL_INFO sinfo = (PSYMBOL_INFO)buf;
     sinfo->SizeOfStruct = sizeof(SYMBOL_INFO);
     sinfo->MaxNameLen = 1024;
     if(::SymFromName(::GetCurrentProcess(), name, sinfo)==FALSE) {
+        if(m_hostmisses.size()>=max_host_misses) { clearHostSymbolMisses(); }
+        m_hostmiss_index.insert(hash, (uint32_t)m_hostmisses.size());
+        m_hostmisses.push_back(m_hostmiss_names.intern(name));
         return nullptr;
     }
-    char *namebuf = new char[sinfo->NameLen+1];
-    strncpy(namebuf, sinfo->Name, sinfo->NameLen+1);
-    m_hostsymbols.addSymbol(newSymbol(namebuf, (void*)sinfo->Address, g_host_symbol_flags, 0, nullptr));
-    m_hostsymbols.sort();
-    return m_hostsymbols.findSymbolByName(name);
+    const char *namebuf = m_hostnames.intern(sinfo->Name, sinfo->NameLen);
+    // 名前での検索は追加直後から有効なので、ソートはある程度溜まってからまとめて行う
+    m_hostsymbols.addSymbol(namebuf, (void*)sinfo->Address, g_host_symbol_flags, sinfo->Size);
+    m_hostsymbols.mergePending(false);
+    return m_hostsymbols.findSymbolByName(namebuf);
 }
 
 dpSymbol* dpLoader::findHostSymbolByAddress(void *addr)
@@ -42,27 +61,37 @@ dpSymbol* dpLoader::findHostSymbolByAddress(void *addr)
     sinfo->SizeOfStruct = sizeof(SYMBOL_INFO);
     sinfo->MaxNameLen = 1024;
     if(::SymFromAddr(::GetCurrentProcess(), (DWORD64)addr, 0, sinfo)==FALSE) {
-        return false;
+        return nullptr;
+    }
+    // addr が関数の途中を指していた場合、既に登録済みの symbol が返ってくることがある
+    dpSymbol *sym = m_hostsymbols.peekSymbolByName(sinfo->Name);
+    if(!sym) {
+        const char *namebuf = m_hostnames.intern(sinfo->Name, sinfo->NameLen);
+        m_hostsymbols.addSymbol(namebuf, (void*)sinfo->Address, g_host_symbol_flags, sinfo->Size);
+        m_hostsymbols.mergePending(false);
+        sym = m_hostsymbols.peekSymbolByName(namebuf);
     }
-    char *namebuf = new char[sinfo->NameLen+1];
-    strncpy(namebuf, sinfo->Name, sinfo->NameLen+1);
-    m_hostsymbols.addSymbol(newSymbol(namebuf, (void*)sinfo->Address, g_host_symbol_flags, 0, nullptr));
-    m_hostsymbols.sort();
-    return m_hostsymbols.findSymbolByAddress(addr);
+    return sym->address==addr ? sym : nullptr;
 }
 
 
 dpLoader::dpLoader(dpContext *ctx)
-    : m_context(ctx)
+    : m_context(ctx), m_force_host_matcher_dirty(false), m_host_modules_checked(false), m_host_symbols_changed(false)
 {
+    dpGetProcessModules(m_host_modules);
+    std::sort(m_host_modules.begin(), m_host_modules.end());
+    // host の symbol は数が多く、実際に参照されるのはごく一部なので dpSymbol は必要になるまで作らない
+    m_hostsymbols.enableCompactStorage(this);
     loadMapFiles();
 }
 
 dpLoader::~dpLoader()
 {
     while(!m_binaries.empty()) { unloadImpl(m_binaries.front()); }
-    m_hostsymbols.eachSymbols([&](dpSymbol *sym){ deleteSymbol(sym); });
+    releaseRetiredBinaries(false);
     m_hostsymbols.clear();
+    clearHostSymbolMisses();
+    m_hostnames.clear();
 }
 
 bool dpLoader::loadMapFile(const char *path, void *imagebase)
@@ -93,6 +122,7 @@ bool dpLoader::loadMapFile(const char *path, void *imagebase)
             }
         }
     }
+    size_t num_symbols = 0;
     {
         std::regex reg("^ [0-9a-f]{4}:[0-9a-f]{8}       ");
         std::cmatch m;
@@ -108,26 +138,28 @@ bool dpLoader::loadMapFile(const char *path, void *imagebase)
 
                 void *addr = (void*)(rva_plus_base + gap);
                 size_t name_length = std::distance(name_src, name_end);
-                char *name = new char[name_length+1];
-                strncpy(name, name_src, name_length);
-                name[name_length] = '\0';
-                m_hostsymbols.addSymbol(newSymbol(name, addr, g_host_symbol_flags, 0, nullptr));
+                const char *name = m_hostnames.intern(name_src, name_length);
+                m_hostsymbols.addSymbol(name, addr, g_host_symbol_flags);
+                ++num_symbols;
             }
         }
     }
-    m_hostsymbols.sort();
+    m_hostsymbols.mergePending();
     fclose(file);
     m_mapfiles_read.insert(path);
+    clearHostSymbolMisses();
+    m_host_symbols_changed = true;
+
+    const dpStringArena::Stats &stats = m_hostnames.getStats();
+    dpPrintDetail("loaded %s (%d symbols). host symbol names: %d strings, %d/%d bytes\n",
+        path, (int)num_symbols, (int)stats.num_strings, (int)stats.used_bytes, (int)stats.reserved_bytes);
     return true;
 }
 
 size_t dpLoader::loadMapFiles()
 {
     std::vector<HMODULE> modules;
-    DWORD num_modules;
-    ::EnumProcessModules(::GetCurrentProcess(), nullptr, 0, &num_modules);
-    modules.resize(num_modules/sizeof(HMODULE));
-    ::EnumProcessModules(::GetCurrentProcess(), &modules[0], num_modules, &num_modules);
+    dpGetProcessModules(modules);
     size_t ret = 0;
     for(size_t i=0; i<modules.size(); ++i) {
         char path[MAX_PATH];
@@ -141,15 +173,200 @@ size_t dpLoader::loadMapFiles()
     return ret;
 }
 
+const dpStringArena::Stats& dpLoader::getNameArenaStats() const
+{
+    return m_hostnames.getStats();
+}
+
+// dpObjFile::resolveSymbol() の、obj 自身の symbol table を除いた部分と同じ規則で解決する
+const dpSymbol* dpLoader::resolveExternalSymbol(const char *name)
+{
+    if(doesForceHostSymbol(name)) {
+        return findHostSymbolByName(name);
+    }
+    if(const dpSymbol *s=findSymbolByName(name)) {
+        return s;
+    }
+    return findHostSymbolByName(name);
+}
+
+// 全 binary の未定義 symbol の名前を集めて重複を除き、1 度ずつ解決してから各 binary に配る。
+// 未定義の symbol は obj 自身の symbol table には無いので、obj 毎に解決しても結果は変わらない
+void dpLoader::resolveUndefinedSymbols(binary_cont &bins)
+{
+    std::vector<const char*> names;
+    dpEach(bins, [&](dpBinary *bin){
+        bin->eachUndefinedSymbols([&](const char *name){ names.push_back(name); });
+    });
+    auto less = [](const char *a, const char *b){ return strcmp(a, b)<0; };
+    std::sort(names.begin(), names.end(), less);
+    names.erase(std::unique(names.begin(), names.end(), [](const char *a, const char *b){ return strcmp(a, b)==0; }), names.end());
+
+    std::vector<const dpSymbol*> resolved(names.size());
+    for(size_t i=0; i<names.size(); ++i) {
+        resolved[i] = resolveExternalSymbol(names[i]);
+    }
+    dpPrintDetail("resolved %d distinct undefined symbols\n", (int)names.size());
+
+    dpEach(bins, [&](dpBinary *bin){
+        bin->resolveUndefinedSymbols([&](const char *name) -> const dpSymbol* {
+            auto p = std::lower_bound(names.begin(), names.end(), name, less);
+            return p!=names.end() && strcmp(*p, name)==0 ? resolved[std::distance(names.begin(), p)] : nullptr;
+        });
+    });
+}
+
+// 前回 owner (host なら nullptr) の symbol に解決された name が、今回別のものに解決されるか。
+// owner がアンロードされた場合と、新たにロードされた binary が同じ名前の symbol を持ち、かつそれが owner より優先される場合が該当する
+bool dpLoader::isStaleReference(const dpBinary *owner, const char *name)
+{
+    if(owner!=nullptr && std::binary_search(m_unloaded.begin(), m_unloaded.end(), owner)) {
+        return true;
+    }
+    if(!isDefinedByNewBinary(owner, name)) {
+        return false;
+    }
+    // resolveExternalSymbol() と同じ規則で今の解決先を求める。ここではまだ partial link はさせない
+    if(doesForceHostSymbol(name)) {
+        return owner!=nullptr;
+    }
+    const dpSymbol *sym = peekSymbolByName(name);
+    // どの binary の symbol にも無い場合、新たな lib の未ロードの member が定義しているので、loadLibMembers() でそれが使われる
+    return sym==nullptr || sym->binary!=owner;
+}
+
+// 前回解決できなかった name が今回は解決できうるか。
+// 新たにロードされた binary が持っている場合と、host の symbol が増えうることがあった場合が該当する
+bool dpLoader::isResolvableReference(const char *name)
+{
+    return m_host_symbols_changed || isDefinedByNewBinary(nullptr, name);
+}
+
+// 前回のリンク以降にロードされた binary のうち、owner 以外のものが name の symbol を持っているか
+bool dpLoader::isDefinedByNewBinary(const dpBinary *owner, const char *name)
+{
+    for(size_t i=0; i<m_onload_queue.size(); ++i) {
+        dpBinary *bin = m_onload_queue[i];
+        if(bin==owner) { continue; }
+        // 差し替え後の lib に引き継がれた member の symbol であれば、解決先は変わらない
+        const dpSymbol *sym = bin->getSymbolTable().peekSymbolByName(name);
+        if(sym && sym->binary!=owner) {
+            return true;
+        }
+        // 遅延 export の dll はまだ symbol が作られていない名前も持っている
+        if(!sym && bin->getFileType()==dpE_Dll && static_cast<dpDllFile*>(bin)->findExportAddress(name)) {
+            return true;
+        }
+        // 遅延ロードの lib も同様に、まだロードされていない member の名前を持っている
+        if(!sym && bin->getFileType()==dpE_Lib && static_cast<dpLibFile*>(bin)->hasLazyMemberDefining(name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void dpLoader::clearHostSymbolMisses()
+{
+    m_hostmisses.clear();
+    m_hostmiss_index.clear();
+    m_hostmiss_names.clear();
+}
+
+// module 一覧が前回から変わっていれば、DbgHelp に module を読み直させて見つからなかった名前を忘れる
+bool dpLoader::updateHostModules()
+{
+    module_cont modules;
+    dpGetProcessModules(modules);
+    std::sort(modules.begin(), modules.end());
+    if(modules==m_host_modules) { return false; }
+    m_host_modules.swap(modules);
+    ::SymRefreshModuleList(::GetCurrentProcess());
+    clearHostSymbolMisses();
+    m_host_symbols_changed = true;
+    return true;
+}
+
+void dpLoader::clearLazyExportChecks()
+{
+    m_lazy_checked.clear();
+    m_lazy_checked_index.clear();
+    m_lazy_checked_names.clear();
+}
+
 void dpLoader::unloadImpl( dpBinary *bin )
+{
+    detachBinary(bin);
+    destroyBinary(bin);
+    // bin に差し替えられる予定だった binary は引き継ぎ先が無くなったので、ここで破棄する
+    for(size_t i=0; i<m_retired.size(); ) {
+        if(m_retired[i].second==bin) {
+            releaseBinary(m_retired[i].first);
+            m_retired.erase(m_retired.begin()+i);
+        }
+        else {
+            ++i;
+        }
+    }
+}
+
+// loader の管理下から外す。symbol の検索やリンクの対象にはならなくなるが、メモリや patch はそのまま残る
+void dpLoader::detachBinary(dpBinary *bin)
 {
     m_binaries.erase(std::find(m_binaries.begin(), m_binaries.end(), bin));
+    m_lazy_dlls.erase(std::remove(m_lazy_dlls.begin(), m_lazy_dlls.end(), bin), m_lazy_dlls.end());
+    m_onload_queue.erase(std::remove(m_onload_queue.begin(), m_onload_queue.end(), bin), m_onload_queue.end());
+    m_symbol_index.removeTable(&bin->getSymbolTable());
+    // これを参照している binary は次のリンクで解決し直す。lib の symbol の持ち主は中の obj
+    m_unloaded.push_back(bin);
+    if(bin->getFileType()==dpE_Lib) {
+        static_cast<dpLibFile*>(bin)->eachObjs([&](dpObjFile *o){ m_unloaded.push_back(o); });
+    }
+}
+
+void dpLoader::destroyBinary(dpBinary *bin)
+{
     bin->callHandler(dpE_OnUnload);
+    releaseBinary(bin);
+}
+
+// OnUnload は呼ばずにメモリだけ解放する
+void dpLoader::releaseBinary(dpBinary *bin)
+{
     std::string path = bin->getPath();
     delete bin;
     dpPrintInfo("unloaded \"%s\"\n", path.c_str());
 }
 
+// OnUnload は差し替えの時点で呼ぶ。メモリの解放だけを次のリンクまで遅らせる
+void dpLoader::retireBinary(dpBinary *old, dpBinary *replacement)
+{
+    detachBinary(old);
+    old->callHandler(dpE_OnUnload);
+    // リンク前にもう一度差し替えられた場合、patch の引き継ぎ元は最初の binary のまま
+    for(size_t i=0; i<m_retired.size(); ++i) {
+        if(m_retired[i].second==old) {
+            m_retired[i].second = replacement;
+            releaseBinary(old);
+            return;
+        }
+    }
+    m_retired.push_back(std::make_pair(old, replacement));
+}
+
+// 差し替えられた binary を解放する。retarget が true なら、中身の変わらない関数の patch を差し替え先に向け直してから解放する。
+// 残った patch は破棄の際に解除され、差し替え先の関数で patch し直されることになる
+void dpLoader::releaseRetiredBinaries(bool retarget)
+{
+    dpEach(m_retired, [&](std::pair<dpBinary*, dpBinary*> &r){
+        if(retarget) {
+            size_t n = dpGetPatcher()->retargetPatches(r.first, r.second);
+            dpPrintDetail("%d unchanged functions kept patched (\"%s\")\n", (int)n, r.second->getPath());
+        }
+        releaseBinary(r.first);
+    });
+    m_retired.clear();
+}
+
 void dpLoader::addOnLoadList(dpBinary *bin)
 {
     m_onload_queue.push_back(bin);
@@ -167,9 +384,21 @@ BinaryType* dpLoader::loadBinaryImpl(const char *path)
     }
 
     BinaryType *ret = new BinaryType(m_context);
+    // lib の場合、中身の変わらない member は差し替え前の lib から引き継ぐ
+    if(old && ret->getFileType()==dpE_Lib) {
+        static_cast<dpLibFile*>((dpBinary*)ret)->setPredecessor(static_cast<dpLibFile*>((dpBinary*)old));
+    }
     if(ret->loadFile(path)) {
-        if(old) { unloadImpl(old); }
+        if(old) { retireBinary(old, ret); }
         m_binaries.push_back(ret);
+        m_symbol_index.addTable(&ret->getSymbolTable());
+        // dll のロードで host 側から見える symbol が増えている可能性がある
+        if(ret->getFileType()==dpE_Dll) { clearHostSymbolMisses(); }
+        // 遅延 export の dll は、既に引いた名前も export しているかもしれない
+        if(ret->getFileType()==dpE_Dll && static_cast<dpDllFile*>((dpBinary*)ret)->hasLazyExports()) {
+            m_lazy_dlls.push_back(ret);
+            clearLazyExportChecks();
+        }
         addOnLoadList(ret);
         dpPrintInfo("loaded \"%s\"\n", ret->getPath());
     }
@@ -229,11 +458,49 @@ bool dpLoader::link()
     if(m_onload_queue.empty()) {
         return true;
     }
+    // 以降の host symbol の検索では module 一覧を調べ直さない
+    updateHostModules();
+    m_host_modules_checked = true;
+
+    // リンクするのは新たにロードされた binary と、差し替えられた binary を参照していた binary だけ。
+    // 新たにロードされた lib も、引き継いだ member が差し替えられた member を参照していることがあるので判定は行う
+    std::sort(m_unloaded.begin(), m_unloaded.end());
+    binary_cont targets;
+    auto collect_targets = [&](){
+        eachBinaries([&](dpBinary *bin){
+            bool is_new = std::find(m_onload_queue.begin(), m_onload_queue.end(), bin)!=m_onload_queue.end();
+            bool is_stale = bin->invalidateLink(
+                [&](const dpBinary *owner, const char *name){ return isStaleReference(owner, name); },
+                [&](const char *name){ return isResolvableReference(name); });
+            if((is_new || is_stale) && std::find(targets.begin(), targets.end(), bin)==targets.end()) {
+                targets.push_back(bin);
+            }
+        });
+    };
+    collect_targets();
+    // ロードされた lib の member は、targets 以外の binary が参照している名前も定義しているかもしれない。
+    // member がロードされなくなるまで判定をやり直す
+    while(loadLibMembers(targets)>0) {
+        collect_targets();
+    }
+    m_unloaded.clear();
+    m_host_symbols_changed = false;
+    dpPrintDetail("linking %d of %d binaries\n", (int)targets.size(), (int)getNumBinaries());
 
+    // 遅延リンクの場合、symbol は section が partialLink() される時に解決する。
+    // ここでまとめて解決すると、見つかった symbol の partialLink() が連鎖してロード時に全てリンクされてしまう
+    if((dpGetConfig().sys_flags&dpE_SysDelayedLink)==0) {
+        resolveUndefinedSymbols(targets);
+    }
     bool ret = true;
-    eachBinaries([&](dpBinary *bin){
-        if(!bin->link()) { ret=false; }
-    });
+    if((dpGetConfig().sys_flags&dpE_SysDelayedLink)==0 && (dpGetConfig().sys_flags&dpE_SysParallelLink)!=0) {
+        ret = linkParallel(targets);
+    }
+    else {
+        dpEach(targets, [&](dpBinary *bin){
+            if(!bin->link()) { ret=false; }
+        });
+    }
 
     if((dpGetConfig().sys_flags&dpE_SysDelayedLink)==0) {
         if(ret) {
@@ -245,6 +512,22 @@ bool dpLoader::link()
         }
     }
 
+    if((dpGetConfig().log_flags&dpE_LogDetail)!=0) {
+        dpCodeHeap::Stats hs;
+        dpGetCodeHeap().getStats(hs);
+        dpPrintDetail("code heap: %d KB reserved, %d large blocks (%d KB)\n",
+            (int)(hs.reserved_size/1024), (int)hs.num_large, (int)(hs.large_size/1024));
+        for(size_t i=0; i<dpCodeHeap::num_classes; ++i) {
+            const dpCodeHeap::ClassStats &cs = hs.classes[i];
+            if(cs.num_chunks==0) { continue; }
+            dpPrintDetail("  %6d byte blocks: %d used, %d chunks\n", (int)cs.block_size, (int)cs.num_blocks, (int)cs.num_chunks);
+        }
+    }
+
+    // 差し替えられた binary の patch のうち、中身の変わらない関数のものは引き継ぐ。
+    // 引き継がれた関数は下の patch() では何もしない
+    releaseRetiredBinaries(true);
+
     // 有効にされていれば dllexport な関数を自動的に patch
     if((dpGetConfig().sys_flags&dpE_SysPatchExports)!=0) {
         dpEach(m_onload_queue, [&](dpBinary *b){
@@ -259,30 +542,136 @@ bool dpLoader::link()
     // OnLoad があれば呼ぶ
     dpEach(m_onload_queue, [&](dpBinary *b){ b->callHandler(dpE_OnLoad); });
     m_onload_queue.clear();
+    m_host_modules_checked = false;
 
     return ret;
 }
 
-dpSymbol* dpLoader::findSymbolByName(const char *name)
+// symbol の解決は全て先に逐次で済ませ、section 単位の再配置だけを並列に行う。
+// 再配置は section 毎に書き込み先が独立しているので、ロックは要らない
+bool dpLoader::linkParallel(binary_cont &bins)
 {
-    size_t n = m_binaries.size();
-    for(size_t i=0; i<n; ++i) {
-        if(dpSymbol *s = m_binaries[i]->getSymbolTable().findSymbolByName(name)) {
-            return s;
+    bool ret = true;
+    std::vector<dpObjFile*> objs;
+    dpEach(bins, [&](dpBinary *bin){
+        switch(bin->getFileType()) {
+        case dpE_Obj: objs.push_back(static_cast<dpObjFile*>(bin)); break;
+        case dpE_Lib: static_cast<dpLibFile*>(bin)->eachObjs([&](dpObjFile *o){ objs.push_back(o); }); break;
+        default:      if(!bin->link()) { ret=false; } break;
         }
-    }
-    return nullptr;
+    });
+
+    typedef std::pair<dpObjFile*, size_t> task_t;
+    std::vector<task_t> tasks;
+    dpEach(objs, [&](dpObjFile *o){
+        o->prepareParallelLink();
+        for(size_t si=0; si<o->getNumSections(); ++si) {
+            tasks.push_back(task_t(o, si));
+        }
+    });
+
+    volatile LONG failed = 0;
+    dpParallelFor(tasks.size(), [&](size_t i){
+        if(!tasks[i].first->partialLink(tasks[i].second)) {
+            ::InterlockedExchange(&failed, 1);
+        }
+    });
+    dpPrintDetail("relocated %d sections of %d objs in parallel\n", (int)tasks.size(), (int)objs.size());
+    return ret && failed==0;
 }
 
-dpSymbol* dpLoader::findSymbolByAddress(void *addr)
+// 遅延ロードされた lib から、targets が参照していてロード済みの binary では解決できない symbol を定義している member をロードする。
+// ロードした member が参照する symbol も同様に辿る。member がロードされた lib は targets と m_onload_queue に加える。
+// ロードした member の数を返す
+size_t dpLoader::loadLibMembers(binary_cont &targets)
 {
-    size_t n = m_binaries.size();
-    for(size_t i=0; i<n; ++i) {
-        if(dpSymbol *s = m_binaries[i]->getSymbolTable().findSymbolByAddress(addr)) {
-            return s;
+    std::vector<dpLibFile*> libs;
+    eachBinaries([&](dpBinary *bin){
+        if(bin->getFileType()==dpE_Lib && static_cast<dpLibFile*>(bin)->hasLazyMembers()) {
+            libs.push_back(static_cast<dpLibFile*>(bin));
         }
+    });
+    if(libs.empty()) { return 0; }
+
+    auto less = [](const char *a, const char *b){ return strcmp(a, b)<0; };
+    size_t num_loaded = 0;
+    binary_cont pending = targets;
+    while(!pending.empty()) {
+        std::vector<const char*> names;
+        dpEach(pending, [&](dpBinary *bin){
+            bin->eachUndefinedSymbols([&](const char *name){
+                if(!doesForceHostSymbol(name) && !peekSymbolByName(name)) { names.push_back(name); }
+            });
+        });
+        pending.clear();
+        if(names.empty()) { break; }
+        std::sort(names.begin(), names.end(), less);
+        names.erase(std::unique(names.begin(), names.end(), [](const char *a, const char *b){ return strcmp(a, b)==0; }), names.end());
+
+        dpEach(libs, [&](dpLibFile *lib){
+            std::vector<dpObjFile*> loaded;
+            if(lib->loadMembersDefining(names, loaded)==0) { return; }
+            // 外して入れ直すと lib の優先順位が最後になってしまうので、増えた symbol だけを lib の位置のまま加える
+            dpSymbolTable &table = lib->getSymbolTable();
+            lib->mergeMemberSymbols(loaded);
+            dpEach(loaded, [&](dpObjFile *o){
+                o->eachSymbols([&](dpSymbol *sym){
+                    // 同名の symbol が lib に既にあった場合は lib の table に入っていない
+                    if(table.peekSymbolByName(sym->name)==sym) { m_symbol_index.addSymbol(sym, &table); }
+                });
+            });
+            if(std::find(targets.begin(), targets.end(), lib)==targets.end()) { targets.push_back(lib); }
+            if(std::find(m_onload_queue.begin(), m_onload_queue.end(), lib)==m_onload_queue.end()) { addOnLoadList(lib); }
+            pending.insert(pending.end(), loaded.begin(), loaded.end());
+            num_loaded += loaded.size();
+        });
     }
-    return nullptr;
+    if(num_loaded) {
+        dpPrintDetail("loaded %d lib members on demand\n", (int)num_loaded);
+    }
+    return num_loaded;
+}
+
+dpSymbol* dpLoader::findSymbolByName(const char *name)
+{
+    // 遅延 export の dll は問い合わせのあった名前の symbol だけを作る。
+    // 名前毎に最初の 1 回だけ全ての dll を引き、見つかったものは dll の位置のまま index に加える。
+    // どれが優先されるかは、全 export を列挙した場合と同じく index のロード順で決まる
+    checkLazyExports(name);
+    return m_symbol_index.findSymbolByName(name);
+}
+
+// findSymbolByName() と同じだが partial link を行わない
+dpSymbol* dpLoader::peekSymbolByName(const char *name)
+{
+    checkLazyExports(name);
+    return m_symbol_index.peekSymbolByName(name);
+}
+
+void dpLoader::checkLazyExports(const char *name)
+{
+    if(m_lazy_dlls.empty()) { return; }
+    uint32_t hash = dpHashName(name);
+    if(m_lazy_checked_index.find(hash, [&](uint32_t i){ return strcmp(m_lazy_checked[i], name)==0; })!=dpNameIndex::npos) {
+        return;
+    }
+    dpEach(m_lazy_dlls, [&](dpBinary *bin){
+        if(dpSymbol *sym = static_cast<dpDllFile*>(bin)->findExport(name)) {
+            m_symbol_index.addSymbol(sym, &bin->getSymbolTable());
+        }
+    });
+    m_lazy_checked_index.insert(hash, (uint32_t)m_lazy_checked.size());
+    m_lazy_checked.push_back(m_lazy_checked_names.intern(name));
+}
+
+dpSymbol* dpLoader::findSymbolByAddress(void *addr)
+{
+    return m_symbol_index.findSymbolByAddress(addr);
+}
+
+dpSymbol* dpLoader::findSymbolContainingAddress(void *addr)
+{
+    return m_symbol_index.findSymbolContainingAddress(addr);
 }
 
 size_t dpLoader::getNumBinaries() const
@@ -303,34 +692,64 @@ dpBinary* dpLoader::findBinary(const char *name)
     return p!=m_binaries.end() ? *p : nullptr;
 }
 
-dpSymbol* dpLoader::newSymbol(const char *nam, void *addr, int fla, int sect, dpBinary *bin)
+dpSymbol* dpLoader::newSymbol(const char *nam, void *addr, int fla, int sect, dpBinary *bin, size_t siz)
 {
-    return new (m_symalloc.allocate()) dpSymbol(nam, addr, fla, sect, bin);
+    void *mem;
+    {
+        dpMutex::ScopedLock lock(m_symalloc_mutex);
+        mem = m_symalloc.allocate();
+    }
+    return new (mem) dpSymbol(nam, addr, fla, sect, bin, siz);
 }
 
 void dpLoader::deleteSymbol(dpSymbol *sym)
 {
     sym->~dpSymbol();
+    dpMutex::ScopedLock lock(m_symalloc_mutex);
     m_symalloc.deallocate(sym);
 }
 
 void dpLoader::addForceHostSymbolPattern(const char *pattern)
 {
-    m_force_host_symbol_patterns.push_back(std::regex(pattern));
+    std::regex validate(pattern); // 不正な pattern はここで例外を投げる
+    m_force_host_symbol_patterns.push_back(pattern);
+    m_force_host_matcher_dirty = true;
+    clearForceHostVerdicts();
 }
 
 bool dpLoader::doesForceHostSymbol(const char *name)
 {
     if(m_force_host_symbol_patterns.empty()) { return false; }
 
-    char demangled[4096];
-    dpDemangle(name, demangled, sizeof(demangled));
-    bool ret = false;
-    for(size_t i=0; i<m_force_host_symbol_patterns.size(); ++i) {
-        if(std::regex_match(demangled, m_force_host_symbol_patterns[i])) {
-            ret = true;
-            break;
+    uint32_t hash = dpHashName(name);
+    uint32_t vi = m_force_host_verdict_index.find(hash, [&](uint32_t i){ return strcmp(m_force_host_verdicts[i].name, name)==0; });
+    if(vi!=dpNameIndex::npos) { return m_force_host_verdicts[vi].force; }
+
+    if(m_force_host_matcher_dirty) {
+        // (?:p0)|(?:p1)|... の形にまとめ、1 回の regex_match で済ませる
+        std::string combined;
+        for(size_t i=0; i<m_force_host_symbol_patterns.size(); ++i) {
+            if(i!=0) { combined += '|'; }
+            combined += "(?:";
+            combined += m_force_host_symbol_patterns[i];
+            combined += ')';
         }
+        m_force_host_matcher = std::regex(combined, std::regex::ECMAScript|std::regex::optimize);
+        m_force_host_matcher_dirty = false;
     }
-    return ret;
+
+    char demangled[4096];
+    dpDemangle(name, demangled, sizeof(demangled));
+    if(m_force_host_verdicts.size()>=max_force_host_verdicts) { clearForceHostVerdicts(); }
+    ForceHostVerdict v = { m_force_host_verdict_names.intern(name), std::regex_match(demangled, m_force_host_matcher) };
+    m_force_host_verdict_index.insert(hash, (uint32_t)m_force_host_verdicts.size());
+    m_force_host_verdicts.push_back(v);
+    return v.force;
+}
+
+void dpLoader::clearForceHostVerdicts()
+{
+    m_force_host_verdicts.clear();
+    m_force_host_verdict_index.clear();
+    m_force_host_verdict_names.clear();
 }
@@ -155,6 +155,42 @@ void dpPatcher::unpatchImpl(const dpPatchData &pi)
     }
 }
 
+// 元コードの退避やトランポリンの確保はやり直さず、飛び先だけを書き換える
+bool dpPatcher::retargetImpl(dpPatchData &pi, const dpSymbol *hook)
+{
+    BYTE *target = (BYTE*)pi.target->address;
+    BYTE *to = (BYTE*)hook->address;
+    HANDLE proc = ::GetCurrentProcess();
+    if(pi.trampoline) {
+        // トランポリンは確保した時点で書き込み可能
+        dpAddJumpInstruction((BYTE*)pi.trampoline, to);
+        ::FlushInstructionCache(proc, pi.trampoline, 32);
+    }
+    else {
+        DWORD_PTR dwDistance = to < target ? target - to : to - target;
+        if(dwDistance > 0x7fff0000) { return false; }
+        DWORD old;
+        ::VirtualProtect(target, 32, PAGE_EXECUTE_READWRITE, &old);
+        dpAddJumpInstruction(target, to);
+        ::FlushInstructionCache(proc, target, 32);
+        ::VirtualProtect(target, 32, old, &old);
+    }
+    pi.hook = hook;
+
+    if((dpGetConfig().log_flags&dpE_LogDetail)!=0) {
+        char demangled[512];
+        dpDemangle(pi.target->name, demangled, sizeof(demangled));
+        dpPrintDetail("retarget 0x%p -> 0x%p (\"%s\" : \"%s\")\n", pi.target->address, hook->address, demangled, pi.target->name);
+    }
+    return true;
+}
+
+static uint64_t dpGetFunctionHash(const dpSymbol *sym)
+{
+    if(sym->binary==nullptr || sym->binary->getFileType()!=dpE_Obj) { return 0; }
+    return static_cast<dpObjFile*>(sym->binary)->getSectionHash(sym->section);
+}
+
 
 dpPatcher::dpPatcher(dpContext *ctx)
     : m_context(ctx)
@@ -177,12 +213,28 @@ void* dpPatcher::patchByBinary(dpBinary *obj, const std::function<bool (const dp
     return nullptr;
 }
 
+void* dpPatcher::patchByBinary(dpBinary *obj, const dpSymbolFilter &filter)
+{
+    filter.eachCandidates(obj->getSymbolTable(), [&](dpSymbol *sym){
+        if(dpIsFunction(sym->flags) && filter.match(sym->name)) {
+            sym->partialLink();
+            patch(dpGetLoader()->findHostSymbolByName(sym->name), sym);
+        }
+    });
+    return nullptr;
+}
+
 void* dpPatcher::patch(dpSymbol *target, dpSymbol *hook)
 {
     if(!target || !hook) { return nullptr; }
     if(dpIsLinkFailed(target->flags) || dpIsLinkFailed(hook->flags)) { return nullptr; }
     if(dpGetLoader()->doesForceHostSymbol(target->name)) { return nullptr; }
 
+    // retargetPatches() で既にこの関数に向けられている場合など
+    auto p = findPatchByAddressImpl(target->address);
+    if(p!=m_patches.end() && p->target==target && p->hook==hook) {
+        return p->unpatched;
+    }
     unpatchByAddress(target->address);
 
     dpPatchData pd;
@@ -194,6 +246,28 @@ void* dpPatcher::patch(dpSymbol *target, dpSymbol *hook)
 }
 
 
+// old の symbol は old の破棄時に消えるので、中身が同じ関数でも replacement の方に向け直す必要はある。
+// ただ unpatch して patch し直すのに比べ、命令の解析やトランポリンの確保が要らず、飛び先の書き換えだけで済む
+size_t dpPatcher::retargetPatches(dpBinary *old, dpBinary *replacement)
+{
+    size_t n = 0;
+    dpEach(m_patches, [&](const dpPatchData &cp){
+        dpPatchData &pd = const_cast<dpPatchData&>(cp); // 書き換えるのは hook だけなので順序は変わらない
+        if(old->getSymbolTable().peekSymbolByName(pd.hook->name)!=pd.hook) { return; }
+        uint64_t hash = dpGetFunctionHash(pd.hook);
+        if(hash==0) { return; }
+
+        dpSymbol *sym = replacement->getSymbolTable().peekSymbolByName(pd.hook->name);
+        if(!sym || !dpIsFunction(sym->flags) || dpGetFunctionHash(sym)!=hash) { return; }
+        // lib の member が差し替え先に引き継がれた場合は hook がそのまま生きている
+        if(sym==pd.hook) { ++n; return; }
+        sym->partialLink();
+        if(dpIsLinkFailed(sym->flags)) { return; }
+        if(retargetImpl(pd, sym)) { ++n; }
+    });
+    return n;
+}
+
 size_t dpPatcher::unpatchByBinary(dpBinary *obj)
 {
     size_t n = 0;